@@ -25,49 +25,31 @@
 #include "e2defrag.h"
 #include "extree.h"
 
-/* Please note that the algorithm below is quite horribly inefficient, and
-   it would almost certainly be faster to just start from the root and
-   perform a binary search, than the current algorithm of performing a linear
-   search from the (ideally far away) hint. */
+/* Most extents consolidate_free_space() moves at once */
+#define MAX_RUN_EXTENTS 64
+
+/* Returns a free extent other than exclude with a size between min_size and
+ * max_size, or NULL (with errno set to ENOSPC) if there is none. A near fit
+ * from the size class lists is used if possible, otherwise the smallest one.
+ */
 static struct free_extent *find_free_extent(struct defrag_ctx *c,
                                             e2_blkcnt_t min_size,
                                             e2_blkcnt_t max_size,
-                                            struct rb_node *hint)
+                                            struct free_extent *exclude)
 {
 	struct free_extent *target;
-	struct rb_node *next;
-	e2_blkcnt_t next_size = 0;
-	if (!hint)
-		hint = rb_first(&c->free_tree_by_size);
-	if (!hint) {
-		errno = ENOSPC;
-		return NULL;
-	}
-	next = hint;
 
-	while (next_size < min_size && next_size <= max_size) {
-		/* Find bigger extents */
-		hint = next;
-		next = rb_prev(hint);
-		if (!next)
-			break;
-		target = rb_entry(next, struct free_extent, size_rb);
-		next_size = target->end_block - target->start_block + 1;
-	}
-	next_size = min_size + 1;
-	next = hint;
-	while (next_size >= min_size) {
-		/* Find smaller extents */
-		hint = next;
-		next = rb_prev(hint);
-		if (!next)
-			break;
-		target = rb_entry(next, struct free_extent, size_rb);
-		next_size = target->end_block - target->start_block + 1;
+	target = free_extent_near_fit(c, min_size);
+	if (target && target != exclude
+	    && target->end_block - target->start_block + 1 <= max_size)
+		return target;
+	target = free_extent_by_size(c, min_size);
+	if (target && target == exclude) {
+		struct rb_node *next = rb_next(&target->size_rb);
+		target = next ? rb_entry(next, struct free_extent, size_rb)
+		              : NULL;
 	}
-	target = rb_entry(hint, struct free_extent, size_rb);
-	next_size = target->end_block - target->start_block + 1;
-	if (next_size < min_size || next_size > max_size) {
+	if (!target || target->end_block - target->start_block + 1 > max_size) {
 		errno = ENOSPC;
 		return NULL;
 	}
@@ -89,96 +71,254 @@ static e2_blkcnt_t real_extent_count(struct allocation *alloc)
 	return ret;
 }
 
-/* Returns whether the given allocation has more extents than is strictly
- * needed on the disk. This function is slightly pessimistic (return true
- * for some allocations that are not really fragmented)
+/* Returns how much the fragmentation of the allocation hurts: the number
+ * of extents it has beyond what is strictly needed on the disk, times its
+ * size. This is 0 if the allocation is not fragmented. Like is_fragmented()
+ * this is slightly pessimistic.
  */
-static int is_fragmented(struct defrag_ctx *c, struct allocation *alloc)
+uint64_t fragmentation_score(struct defrag_ctx *c, struct allocation *alloc)
 {
-	e2_blkcnt_t flex_bg_size = 1, min_extents;
-
-	if (EXT2_HAS_INCOMPAT_FEATURE(&c->sb, EXT4_FEATURE_INCOMPAT_FLEX_BG))
-		flex_bg_size = 1 << (c->sb.s_log_groups_per_flex);
+	e2_blkcnt_t flex_bg_size = flex_bg_blocks(c), min_extents, extents;
 
-	flex_bg_size *= c->sb.s_blocks_per_group;
 	min_extents = (alloc->block_count + flex_bg_size - 1) / flex_bg_size;
 	if (alloc->extent_count <= min_extents)
 		return 0;
 
-	if (real_extent_count(alloc) <= min_extents)
+	extents = real_extent_count(alloc);
+	if (extents <= min_extents)
 		return 0;
-	return 1;
+	return (extents - min_extents) * alloc->block_count;
 }
 
-static int try_pack_extent(struct defrag_ctx *c, struct data_extent *data,
-                           struct free_extent *away_from)
+/* Returns whether the given allocation has more extents than is strictly
+ * needed on the disk. This function is slightly pessimistic (return true
+ * for some allocations that are not really fragmented)
+ */
+static int is_fragmented(struct defrag_ctx *c, struct allocation *alloc)
 {
-	struct free_extent *target;
-	struct allocation *new_alloc;
-	struct data_extent *before;
-	blk64_t new_start;
-	e2_blkcnt_t min_size, max_size;
-	int ret;
+	return fragmentation_score(c, alloc) != 0;
+}
 
-	before = containing_data_extent(c, data->start_block - 1);
-	if (before && before->inode_nr == data->inode_nr)
-		return ENOSPC; /* TODO: proper multi-extent moves */
-	min_size = data->end_block - data->start_block + 1;
-	/* Don't add 1 to max_size (or rather, subtract one from the final
-	   result, so we actually gain something by moving */
-	max_size = min_size + away_from->end_block - away_from->start_block;
+/* Moves a single extent of data or metadata to the blocks starting at
+ * new_start. These must be free, except that a data extent may also be slid
+ * over its own blocks.
+ */
+int move_extent(struct defrag_ctx *c, struct data_extent *data,
+                blk64_t new_start)
+{
+	struct allocation *new_alloc;
+	struct data_extent *new_extent;
+	ext2_ino_t inode_nr = data->inode_nr;
+	blk64_t old_start = data->start_block;
+	e2_blkcnt_t num_blocks = data->end_block - data->start_block + 1;
+	int ret, uninit = data->uninit;
+	int overlap = new_start <= data->end_block
+	              && new_start + num_blocks > data->start_block;
 
-	target = find_free_extent(c, min_size, max_size, &away_from->size_rb);
-	if (!target)
+	if (overlap && (new_start == old_start || is_metadata(c, data))) {
+		errno = EINVAL;
 		return -1;
-	if (target == away_from) {
-		/* There cannot be any smaller extents, so we only try
-		   the bigger ones. */
-		struct rb_node *prev_node;
-		prev_node = rb_prev(&target->size_rb);
-		if (!prev_node) {
-			errno = ENOSPC;
-			return -1;
-		}
-		target = rb_entry(prev_node, struct free_extent, size_rb);
-		if (target->end_block - target->start_block + 1 > max_size) {
-			/* Can't be smaller then min_size, or find_free_block
-			   wouldn't have returned the smaller target */
-			errno = ENOSPC;
-			return -1;
-		}
-	}
-	new_start = target->start_block;
-	if (global_settings.interactive) {
-		printf("Moving extent starting at %llu (inode %u, %llu blocks)"
-		       " to %llu\n",
-		       data->start_block, data->inode_nr, 
-		       data->end_block - data->start_block + 1, new_start);
 	}
 	new_alloc = malloc(sizeof(struct allocation) + sizeof(struct data_extent));
 	if (!new_alloc)
 		return -1;
-	new_alloc->block_count = data->end_block - data->start_block + 1;
+	new_extent = &new_alloc->extents[0];
+	new_alloc->block_count = num_blocks;
 	new_alloc->extent_count = 1;
-	new_alloc->extents[0].start_block = target->start_block;
-	new_alloc->extents[0].end_block = target->start_block;
-	new_alloc->extents[0].end_block += data->end_block - data->start_block;
-	new_alloc->extents[0].start_logical = data->start_logical;
-	new_alloc->extents[0].inode_nr = data->inode_nr;
-	new_alloc->extents[0].uninit = data->uninit;
+	new_extent->start_logical = data->start_logical;
+	new_extent->inode_nr = data->inode_nr;
+	new_extent->uninit = data->uninit;
+	/* Of an overlapping target, only the part outside data is allocated */
+	if (overlap && new_start < old_start) {
+		new_extent->start_block = new_start;
+		new_extent->end_block = old_start - 1;
+	} else if (overlap) {
+		new_extent->start_block = data->end_block + 1;
+		new_extent->end_block = new_start + num_blocks - 1;
+	} else {
+		new_extent->start_block = new_start;
+		new_extent->end_block = new_start + num_blocks - 1;
+	}
+	new_alloc->block_count =
+	        new_extent->end_block - new_extent->start_block + 1;
 	ret = allocate(c, new_alloc);
 	if (ret) {
 		free(new_alloc);
 		return -1;
 	}
-	if (is_metadata(c, data))
+	new_alloc->block_count = num_blocks;
+	new_extent->start_block = new_start;
+	new_extent->end_block = new_start + num_blocks - 1;
+	if (is_metadata(c, data)) {
+		uninit = 0;
 		ret = move_metadata_extent(c, data, new_alloc);
-	else
+	} else {
 		ret = move_data_extent(c, data, new_alloc);
+	}
 	free(new_alloc);
+	if (ret >= 0) {
+		frag_queue_update(c, inode_nr);
+		plan_extent_move(c, inode_nr, old_start, num_blocks, new_start,
+		                 uninit);
+	}
 	return ret;
 }
 
+/* Moves the extents in the nr_blocks used blocks starting at from, which may
+ * belong to several inodes, to the free blocks starting at to. The metadata
+ * of every inode involved is written only once, after all data is copied,
+ * and the old data blocks are only freed after that.
+ */
+int move_extent_run(struct defrag_ctx *c, blk64_t from,
+                    e2_blkcnt_t nr_blocks, blk64_t to)
+{
+	struct allocation *target;
+	ext2_ino_t inodes[MAX_RUN_EXTENTS];
+	blk64_t free_start[MAX_RUN_EXTENTS];
+	e2_blkcnt_t free_count[MAX_RUN_EXTENTS];
+	int nr_inodes = 0, nr_free = 0, nr_extents = 0, i, ret;
+	ext2_ino_t first_inode = 0;
+	e2_blkcnt_t copied = 0;
+	blk64_t pos = from;
+
+	target = malloc(sizeof(struct allocation) + sizeof(struct data_extent));
+	if (!target)
+		return -1;
+	target->block_count = nr_blocks;
+	target->extent_count = 1;
+	target->extents[0].start_block = to;
+	target->extents[0].end_block = to + nr_blocks - 1;
+	target->extents[0].start_logical = 0;
+	target->extents[0].inode_nr = 0;
+	target->extents[0].uninit = 0;
+	if (allocate(c, target)) {
+		free(target);
+		return -1;
+	}
+	ret = copy_queue_begin(c);
+	while (!ret && pos < from + nr_blocks) {
+		struct data_extent *e = containing_data_extent(c, pos);
+		e2_blkcnt_t size;
+		ext2_ino_t inode_nr;
+		int uninit;
+
+		if (!e || nr_extents == MAX_RUN_EXTENTS) {
+			errno = EINVAL;
+			ret = -1;
+			break;
+		}
+		size = e->end_block - e->start_block + 1;
+		inode_nr = e->inode_nr;
+		uninit = e->uninit;
+		target->block_count = size;
+		target->extents[0] = *e;
+		target->extents[0].start_block = to + (pos - from);
+		target->extents[0].end_block = to + (pos - from) + size - 1;
+		if (is_metadata(c, e)) {
+			uninit = 0;
+			/* Metadata is written through the block cache, which
+			   the copies in flight do not know about */
+			ret = copy_queue_drain(c);
+			if (!ret)
+				ret = move_metadata_extent(c, e, target);
+			if (!ret)
+				frag_queue_update(c, inode_nr);
+		} else {
+			ret = move_data_extent_deferred(c, e, target,
+			                                &free_start[nr_free],
+			                                &free_count[nr_free]);
+			if (!ret)
+				nr_free++;
+			for (i = 0; i < nr_inodes; i++)
+				if (inodes[i] == inode_nr)
+					break;
+			if (i == nr_inodes)
+				inodes[nr_inodes++] = inode_nr;
+		}
+		if (ret < 0)
+			break;
+		if (!nr_extents++)
+			first_inode = inode_nr;
+		if (!uninit)
+			copied += size;
+		pos += size;
+	}
+	if (copy_queue_end(c) < 0)
+		ret = -1;
+	/* The data must be on disk before the metadata points at it */
+	if (!ret)
+		ret = cache_sync(c);
+	/* Give back the part of the target that was not used */
+	if (pos < from + nr_blocks)
+		deallocate_space(c, to + (pos - from), from + nr_blocks - pos);
+	for (i = 0; i < nr_inodes; i++) {
+		if (!ret)
+			ret = write_inode_metadata(c, get_inode(c, inodes[i]));
+		frag_queue_update(c, inodes[i]);
+	}
+	/* If anything failed, the old blocks may still be in use on disk */
+	for (i = 0; i < nr_free && !ret; i++)
+		ret = deallocate_space(c, free_start[i], free_count[i]);
+	/* Replayed as a whole, so the space is allocated in the same way */
+	if (!ret)
+		plan_run_move(c, first_inode, from, nr_blocks, to, nr_extents,
+		              copied);
+	free(target);
+	return ret;
+}
+
+/* Moves data away from the free extent away_from, so that it grows. The
+ * extent data borders on away_from, and is moved together with the extents
+ * behind it for as long as they belong to the same inode, since moving only
+ * some of those would fragment it. If a big enough hole exists, the run is
+ * extended over the extents of other inodes as well.
+ */
+static int try_pack_extent(struct defrag_ctx *c, struct data_extent *data,
+                           struct free_extent *away_from)
+{
+	struct free_extent *target = NULL;
+	struct data_extent *e = data;
+	e2_blkcnt_t cuts[MAX_RUN_EXTENTS], blocks = 0, max_size;
+	int backward = data->end_block < away_from->start_block;
+	int nr_extents = 0, nr_cuts = 0;
+	blk64_t run_start;
+
+	while (e && nr_extents < MAX_RUN_EXTENTS) {
+		struct data_extent *next;
+		blocks += e->end_block - e->start_block + 1;
+		nr_extents++;
+		if (backward)
+			next = containing_data_extent(c, e->start_block - 1);
+		else
+			next = containing_data_extent(c, e->end_block + 1);
+		/* The run may only end where it does not split an inode */
+		if (!next || next->inode_nr != e->inode_nr)
+			cuts[nr_cuts++] = blocks;
+		e = next;
+	}
+	/* Try the longest run first, moving it gains the most */
+	while (nr_cuts > 0 && !target) {
+		blocks = cuts[--nr_cuts];
+		/* Don't add 1 to max_size (or rather, subtract one from the
+		   final result, so we actually gain something by moving */
+		max_size = blocks + away_from->end_block - away_from->start_block;
+		target = find_free_extent(c, blocks, max_size, away_from);
+	}
+	if (!target) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (backward)
+		run_start = data->end_block - blocks + 1;
+	else
+		run_start = data->start_block;
+	if (global_settings.interactive) {
+		printf("Moving %llu blocks starting at %llu (inode %u) to %llu\n",
+		       blocks, run_start, data->inode_nr, target->start_block);
+	}
+	return move_extent_run(c, run_start, blocks, target->start_block);
+}
+
 int consolidate_free_space(struct defrag_ctx *c)
 {
 	struct rb_node *n;
@@ -204,7 +344,7 @@ int consolidate_free_space(struct defrag_ctx *c)
 				return ret;
 		}
 		extent_after =
-		        containing_data_extent(c, free_extent->start_block - 1);
+		        containing_data_extent(c, free_extent->end_block + 1);
 		if (extent_after) {
 			int ret;
 			ret = try_pack_extent(c, extent_after, free_extent);
@@ -246,8 +386,9 @@ struct allocation *find_impoved_placement(struct defrag_ctx *c,
 	for (i = 1; i < ret->extent_count; i++) {
 		struct data_extent *cur_extent = &ret->extents[i];
 		struct data_extent *prev_extent = &ret->extents[i - 1];
-		struct free_extent *target;
-		target = containing_free_extent(c, prev_extent->end_block + 1);
+		struct free_extent *target, unindexed;
+		target = free_space_at(c, prev_extent->end_block + 1,
+		                       &unindexed);
 		if (target
 		    && target->end_block - target->start_block
 		       >= cur_extent->end_block - cur_extent->start_block)
@@ -280,6 +421,43 @@ struct allocation *find_impoved_placement(struct defrag_ctx *c,
 	}
 }
 
+/* Switches the inode over to target, to which its data has been copied */
+int switch_inode_data(struct defrag_ctx *c, ext2_ino_t inode_nr,
+                      struct allocation *target)
+{
+	struct inode *inode = get_inode(c, inode_nr);
+	int ret;
+
+	rb_remove_data_alloc(c, inode->data);
+	insert_data_alloc(c, target);
+	ret = deallocate_blocks(c, inode->data);
+	inode->data = target;
+	if (!ret)
+		ret = write_inode_metadata(c, inode);
+	else
+		write_inode_metadata(c, inode);
+	if (!ret)
+		plan_inode_move(c, inode_nr);
+	return ret;
+}
+
+/* Copies the data of the inode to the already allocated target and switches
+ * the inode over to it. The target is released if the copy fails.
+ */
+int move_inode_data(struct defrag_ctx *c, ext2_ino_t inode_nr,
+                    struct allocation *target)
+{
+	struct inode *inode = get_inode(c, inode_nr);
+	int ret;
+
+	ret = copy_data(c, inode->data, &target);
+	if (ret) {
+		deallocate_blocks(c, target);
+		return ret;
+	}
+	return switch_inode_data(c, inode_nr, target);
+}
+
 /* Very naive algorithm for now: Just try to find a combination of free
  * extent big enough to fit the whole file, but consisting of fewer extents
  * than the current one.
@@ -291,9 +469,10 @@ int do_one_inode(struct defrag_ctx *c, ext2_ino_t inode_nr)
 	struct allocation *target;
 	int ret = 0, answer = 0;
 
-	inode = c->inodes[inode_nr];
+	inode = get_inode(c, inode_nr);
 	errno = 0;
-	target = get_blocks(c, inode->data->block_count, inode_nr, 0);
+	target = get_blocks(c, inode->data->block_count, inode_nr, 0,
+	                    inode_goal(c, inode_nr));
 	if (!target) {
 		if (errno)
 			return -1;
@@ -327,19 +506,10 @@ int do_one_inode(struct defrag_ctx *c, ext2_ino_t inode_nr)
 			free(target);
 			return ret;
 		}
-		ret = copy_data(c, inode->data, &target);
-		if (!ret) {
-			rb_remove_data_alloc(c, inode->data);
-			insert_data_alloc(c, target);
-			ret = deallocate_blocks(c, inode->data);
-			inode->data = target;
-			if (!ret)
-				ret = write_inode_metadata(c, inode);
-			else
-				write_inode_metadata(c, inode);
-		} else {
-			deallocate_blocks(c, target);
-		}
+		plan_reservation(c, inode_nr, target);
+		ret = move_inode_data(c, inode_nr, target);
+	} else {
+		free(target);
 	}
 	return ret;
 }
@@ -351,7 +521,7 @@ int do_one_inode(struct defrag_ctx *c, ext2_ino_t inode_nr)
  */ 
 int try_improve_inode(struct defrag_ctx *c, ext2_ino_t inode_nr)
 {
-	struct inode *inode = c->inodes[inode_nr];
+	struct inode *inode = get_inode(c, inode_nr);
 	struct allocation *new_placement, *old_placement, *diff;
 	int ret, i;
 	new_placement = find_impoved_placement(c, inode->data);
@@ -367,7 +537,7 @@ int try_improve_inode(struct defrag_ctx *c, ext2_ino_t inode_nr)
 	ret = copy_data(c, inode->data, &new_placement);
 	if (ret < 0)
 		goto out_free;
-	ret = fdatasync(c->fd);
+	ret = cache_sync(c);
 	if (ret)
 		goto out_free;
 	rb_remove_data_alloc(c, inode->data);
@@ -396,53 +566,264 @@ out_free:
 	return ret;
 }
 
-/* Very stupid algorithm: Start by defragmenting every file starting at inode
-   0 until no more inodes can be defragmented, then consolidate the free space
-   as much as possible and start over. When nothing more can be done, it
-   terminates. */
+struct planned_move {
+	ext2_ino_t inode_nr;
+	e2_blkcnt_t block_count;
+	struct allocation *target;
+};
+
+static int compare_planned_moves(const void *a, const void *b)
+{
+	const struct planned_move *x = a, *y = b;
+
+	if (x->block_count != y->block_count)
+		return x->block_count > y->block_count ? -1 : 1;
+	return x->inode_nr < y->inode_nr ? -1 : x->inode_nr > y->inode_nr;
+}
+
+/* Defragments a batch of inodes together. New space is first planned for
+ * all fragmented inodes, biggest first, and reserved so that smaller files
+ * cannot take the free extents a bigger one needs. Only then is data
+ * copied, with several copies in flight if so configured, after which the
+ * inodes are switched over one by one.
+ * Returns 1 if any inode was moved, 0 if none was and -1 on error.
+ */
+static int do_inode_batch(struct defrag_ctx *c, const ext2_ino_t *inodes,
+                          int count)
+{
+	struct planned_move plan[PLAN_BATCH];
+	int i, nr_planned = 0, moved = 0, ret = 0;
+
+	for (i = 0; i < count; i++) {
+		struct inode *inode = get_inode(c, inodes[i]);
+		if (!is_fragmented(c, inode->data))
+			continue;
+		plan[nr_planned].inode_nr = inodes[i];
+		plan[nr_planned].block_count = inode->data->block_count;
+		plan[nr_planned].target = NULL;
+		nr_planned++;
+	}
+	qsort(plan, nr_planned, sizeof(*plan), compare_planned_moves);
+	for (i = 0; i < nr_planned; i++) {
+		struct inode *inode = get_inode(c, plan[i].inode_nr);
+		struct allocation *target;
+
+		errno = 0;
+		target = get_blocks(c, plan[i].block_count, plan[i].inode_nr,
+		                    0, inode_goal(c, plan[i].inode_nr));
+		if (!target) {
+			if (errno && errno != ENOSPC) {
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+		if (target->extent_count >= inode->data->extent_count
+		    || reserve_blocks(c, target) < 0) {
+			free(target);
+			continue;
+		}
+		plan[i].target = target;
+		plan_reservation(c, plan[i].inode_nr, target);
+	}
+	/* The targets were free space, so no copy overwrites the source of
+	   another one and all of them can be in flight at once */
+	if (ret >= 0 && copy_queue_begin(c) < 0)
+		ret = -1;
+	for (i = 0; i < nr_planned; i++) {
+		struct inode *inode = get_inode(c, plan[i].inode_nr);
+		if (!plan[i].target)
+			continue;
+		if (ret < 0) {
+			cancel_reservation(c, plan[i].target);
+			plan_cancel(c, plan[i].inode_nr);
+			free(plan[i].target);
+			plan[i].target = NULL;
+			continue;
+		}
+		commit_reservation(c, plan[i].target);
+		ret = copy_data(c, inode->data, &plan[i].target);
+		if (ret) {
+			deallocate_blocks(c, plan[i].target);
+			plan_cancel(c, plan[i].inode_nr);
+			plan[i].target = NULL;
+		}
+	}
+	if (copy_queue_end(c) < 0)
+		ret = -1;
+	for (i = 0; i < nr_planned; i++) {
+		if (!plan[i].target)
+			continue;
+		if (ret < 0) {
+			deallocate_blocks(c, plan[i].target);
+			plan_cancel(c, plan[i].inode_nr);
+			continue;
+		}
+		ret = switch_inode_data(c, plan[i].inode_nr, plan[i].target);
+		if (!ret) {
+			moved = 1;
+			frag_queue_update(c, plan[i].inode_nr);
+		}
+	}
+	return ret < 0 ? ret : moved;
+}
+
+/* Rewrites the fragmented metadata of the inodes whose allocation changed
+   since the last call, and of those still fragmented after it. Returns the
+   number of inodes whose metadata is still fragmented afterwards, which
+   stay listed, or -1 on error. */
+static long do_all_metadata(struct defrag_ctx *c, struct frag_queue *q)
+{
+	uint32_t i, kept = 0;
+	int ret = 0;
+
+	for (i = 0; i < q->nr_changed; i++) {
+		ext2_ino_t inode_nr = q->changed[i];
+		struct inode *inode = get_inode(c, inode_nr);
+		if (!ret && inode->metadata
+		    && is_fragmented(c, inode->metadata)) {
+			ret = write_inode_metadata(c, inode);
+			if (!ret)
+				plan_metadata_write(c, inode_nr);
+		}
+		/* Keep the rest listed on error, to be retried */
+		if (ret < 0 || (inode->metadata
+		                && is_fragmented(c, inode->metadata)))
+			q->changed[kept++] = inode_nr;
+		else
+			q->is_changed[inode_nr] = 0;
+	}
+	q->nr_changed = kept;
+	return ret < 0 ? ret : kept;
+}
+
+/* Takes up to PLAN_BATCH of the worst fragmented inodes from the queue */
+static int pop_batch(struct frag_queue *q, ext2_ino_t *batch)
+{
+	int count;
+
+	for (count = 0; count < PLAN_BATCH; count++) {
+		batch[count] = frag_queue_pop(q);
+		if (!batch[count])
+			break;
+	}
+	return count;
+}
+
+/* Defragments the fragmented inodes worst first, in batches taken from a
+   queue. Inodes that cannot be improved are set aside until the free space
+   has changed, by moving other inodes or by consolidating the free space.
+   Fragmented metadata is rewritten after every pass. When nothing more can
+   be done, it terminates. */
 int do_whole_disk(struct defrag_ctx *c)
 {
-	ext2_ino_t i;
-	int ret;
+	struct frag_queue queue;
+	ext2_ino_t batch[PLAN_BATCH];
+	int ret, i, count;
+	long fragmented_metadata;
 	char changed, optimal;
+
+	if (frag_queue_init(c, &queue) < 0)
+		return -1;
+	if (do_all_metadata(c, &queue) < 0) {
+		ret = -1;
+		goto out;
+	}
 	do {
 		changed = 0;
-		optimal = 1;
-		for (i = 0; i < ext2_inodes_on_disk(&c->sb); i++) {
-			struct inode *inode = c->inodes[i];
-			if (!inode)
-				continue;
-			if (is_fragmented(c, inode->data)) {
-				ret = do_one_inode(c, i);
-				if (ret < 0)
-					return ret;
-				else if (ret == 0)
-					changed = 1;
-				/* ret == 1 means could not improve */
-				if (is_fragmented(c, inode->data))
-					optimal = 0;
-			}
-			if (inode->metadata &&
-			    is_fragmented(c, inode->metadata))
-			{
-				ret = write_inode_metadata(c, inode);
-				if (ret < 0)
-					return ret;
+		while ((count = pop_batch(&queue, batch)) > 0) {
+			ret = do_inode_batch(c, batch, count);
+			if (ret < 0)
+				goto out;
+			else if (ret > 0)
 				changed = 1;
-				/* TODO: Too coupled with the algorithm.
-				   Will break on improved algorithm later.
-				   */
-				if (is_fragmented(c, inode->metadata))
-					optimal = 0;
+			/* Improved inodes are queued again by the moves */
+			for (i = 0; i < count; i++) {
+				struct inode *inode = get_inode(c, batch[i]);
+				if (!queue.pos[batch[i]]
+				    && is_fragmented(c, inode->data))
+					frag_queue_stall(&queue, batch[i]);
 			}
 		}
+		/* The moves may have left metadata fragmented again */
+		fragmented_metadata = do_all_metadata(c, &queue);
+		if (fragmented_metadata < 0) {
+			ret = -1;
+			goto out;
+		}
+		optimal = !queue.nr_stalled && !fragmented_metadata;
 		if (!optimal) {
 			ret = consolidate_free_space(c);
 			if (ret < 0)
-				return ret;
+				goto out;
 			else if (ret == 0)
 				changed = 1;
 		}
+		if (changed)
+			frag_queue_retry(c, &queue);
 	} while (changed && !optimal);
+	ret = 0;
+out:
+	frag_queue_destroy(c, &queue);
+	return ret;
+}
+
+/* Slides every extent down into the free space right before it, in the
+   order of their position on the disk. This packs the data toward the
+   start of the disk and leaves the free space behind it, apart from holes
+   in front of blocks that cannot be moved. */
+int do_compact(struct defrag_ctx *c)
+{
+	struct data_extent *data;
+	blk64_t block = 0;
+
+	while ((data = data_extent_after(c, block)) != NULL) {
+		struct free_extent *hole, unindexed;
+		e2_blkcnt_t num_blocks = data->end_block - data->start_block + 1;
+		blk64_t new_start;
+
+		block = data->end_block + 1;
+		if (!data->start_block)
+			continue;
+		hole = free_space_at(c, data->start_block - 1, &unindexed);
+		if (!hole)
+			continue;
+		new_start = hole->start_block;
+		/* Metadata is moved block by block, so it cannot slide over
+		   its own blocks */
+		if (is_metadata(c, data)
+		    && new_start + num_blocks > data->start_block)
+			continue;
+		/* data may be merged into its neighbour by the move */
+		if (move_extent(c, data, new_start) < 0)
+			return -1;
+		block = new_start + num_blocks;
+	}
+	return 0;
+}
+
+/* Defragments only the given inode, as used in single inode mode. */
+int do_single_inode(struct defrag_ctx *c, ext2_ino_t inode_nr)
+{
+	struct inode *inode = get_inode(c, inode_nr);
+	int ret = 0;
+
+	if (inode == NULL || inode->data->extent_count == 0) {
+		printf("Inode %u has no data associated\n", inode_nr);
+		return 0;
+	}
+	if (is_fragmented(c, inode->data)) {
+		ret = do_one_inode(c, inode_nr);
+		if (ret < 0)
+			return ret;
+	}
+	if (inode->metadata && is_fragmented(c, inode->metadata)) {
+		ret = write_inode_metadata(c, inode);
+		if (ret < 0)
+			return ret;
+		plan_metadata_write(c, inode_nr);
+	}
+	printf("Inode %u now has %llu fragments\n", inode_nr,
+	       inode->data->extent_count);
 	return 0;
 }
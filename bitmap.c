@@ -17,6 +17,7 @@
 
 /* Block bitmap management functions */
 
+#include <endian.h>
 #include <limits.h>
 #include <string.h>
 #include <unistd.h>
@@ -26,6 +27,140 @@
 #include "e2defrag.h"
 #include "crc16.h"
 
+#define BITS_PER_WORD (sizeof(uint64_t) * CHAR_BIT)
+
+/* Loads the given 64-bit word of a bitmap of size bits. Bytes past the end
+ * of the bitmap are read as zero, so we never touch memory beyond it.
+ */
+static inline uint64_t bitmap_word(const unsigned char *bitmap,
+                                   unsigned long word, unsigned long size)
+{
+	uint64_t ret = 0;
+	unsigned long nbytes = (size + CHAR_BIT - 1) / CHAR_BIT;
+	nbytes -= word * sizeof(ret);
+	if (nbytes > sizeof(ret))
+		nbytes = sizeof(ret);
+	memcpy(&ret, bitmap + word * sizeof(ret), nbytes);
+	/* On-disk bitmaps are little-endian: bit n is bit n%8 of byte n/8 */
+	return le64toh(ret);
+}
+
+static unsigned long find_next_bit(const unsigned char *bitmap,
+                                   unsigned long size, unsigned long offset,
+                                   uint64_t invert)
+{
+	unsigned long word = offset / BITS_PER_WORD;
+	uint64_t tmp;
+
+	if (offset >= size)
+		return size;
+	tmp = bitmap_word(bitmap, word, size) ^ invert;
+	tmp &= ~(uint64_t)0 << (offset % BITS_PER_WORD);
+	while (!tmp) {
+		word++;
+		if (word * BITS_PER_WORD >= size)
+			return size;
+		tmp = bitmap_word(bitmap, word, size) ^ invert;
+	}
+	offset = word * BITS_PER_WORD + __builtin_ctzll(tmp);
+	return offset < size ? offset : size;
+}
+
+/* Returns the number of the first set bit at or after offset in the bitmap
+ * of size bits, or size if there is none.
+ */
+unsigned long find_next_set_bit(const unsigned char *bitmap,
+                                unsigned long size, unsigned long offset)
+{
+	return find_next_bit(bitmap, size, offset, 0);
+}
+
+/* Like find_next_set_bit, but for the first bit that is not set */
+unsigned long find_next_zero_bit(const unsigned char *bitmap,
+                                 unsigned long size, unsigned long offset)
+{
+	return find_next_bit(bitmap, size, offset, ~(uint64_t)0);
+}
+
+/* Returns the number of the last set bit at or before offset in the bitmap
+ * of size bits, or size if there is none. offset must be below size.
+ */
+static unsigned long find_prev_set_bit(const unsigned char *bitmap,
+                                       unsigned long size,
+                                       unsigned long offset)
+{
+	unsigned long word = offset / BITS_PER_WORD;
+	uint64_t tmp;
+
+	tmp = bitmap_word(bitmap, word, size);
+	tmp &= ~(uint64_t)0 >> (BITS_PER_WORD - 1 - offset % BITS_PER_WORD);
+	while (!tmp) {
+		if (!word)
+			return size;
+		word--;
+		tmp = bitmap_word(bitmap, word, size);
+	}
+	return word * BITS_PER_WORD + BITS_PER_WORD - 1 - __builtin_clzll(tmp);
+}
+
+/* Number of bits in the block bitmap of the group that describe blocks */
+static unsigned long group_bitmap_bits(struct defrag_ctx *c,
+                                       unsigned long group)
+{
+	blk64_t first_block = group * (blk64_t)c->sb.s_blocks_per_group;
+	first_block += c->sb.s_first_data_block;
+	if (first_block + c->sb.s_blocks_per_group > c->sb.s_blocks_count)
+		return c->sb.s_blocks_count - first_block;
+	return c->sb.s_blocks_per_group;
+}
+
+/* Finds the run of blocks that are free in the block bitmaps around block,
+ * which may cross group boundaries. Returns -1 if block is in use.
+ */
+int find_free_run(struct defrag_ctx *c, blk64_t block,
+                  blk64_t *start, blk64_t *end)
+{
+	const unsigned long num_groups = ext2_groups_on_disk(&c->sb);
+	const blk64_t per_group = c->sb.s_blocks_per_group;
+	const blk64_t first = c->sb.s_first_data_block;
+	unsigned long group, bit, nr_bits, pos;
+
+	if (block < first || block >= c->sb.s_blocks_count)
+		return -1;
+	group = (block - first) / per_group;
+	bit = (block - first) % per_group;
+	nr_bits = group_bitmap_bits(c, group);
+	if (find_next_set_bit(c->bg_maps[group].bitmap, nr_bits, bit) == bit)
+		return -1;
+
+	for (pos = bit; ; pos = nr_bits - 1) {
+		pos = find_prev_set_bit(c->bg_maps[group].bitmap, nr_bits, pos);
+		if (pos < nr_bits) {
+			*start = first + group * per_group + pos + 1;
+			break;
+		}
+		if (group == 0) {
+			*start = first;
+			break;
+		}
+		group--;
+		nr_bits = group_bitmap_bits(c, group);
+	}
+
+	group = (block - first) / per_group;
+	nr_bits = group_bitmap_bits(c, group);
+	for (pos = bit; ; pos = 0) {
+		pos = find_next_set_bit(c->bg_maps[group].bitmap, nr_bits, pos);
+		if (pos < nr_bits || group + 1 == num_groups) {
+			*end = first + group * per_group + pos - 1;
+			break;
+		}
+		group++;
+		nr_bits = group_bitmap_bits(c, group);
+	}
+	return 0;
+}
+
 /* Returns the address of the page which was modified */
 static void *__mark_single_block(struct defrag_ctx *c, blk64_t block, char mark)
 {
@@ -0,0 +1,378 @@
+/*
+    Copyright 2009 Enno Ruijters
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of version 2 of the GNU General
+    Public License as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Write-back cache for the metadata blocks accessed through read_block() and
+ * write_block(). Dirty blocks only go to disk when they are evicted or at an
+ * explicit flush point. Callers flush right before the fdatasync/msync
+ * barriers that order the metadata updates, so the on-disk ordering is the
+ * same as without the cache.
+ */
+
+#define _LARGEFILE64_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include "e2defrag.h"
+
+struct cache_block {
+	blk64_t block;
+	struct cache_block *hash_next;
+	struct cache_block *lru_prev, *lru_next;
+	char dirty;
+	unsigned char data[];
+};
+
+struct block_cache {
+	pthread_mutex_t lock;
+	struct cache_block **hash;
+	unsigned long hash_mask;
+	/* lru_first is the most recently used block */
+	struct cache_block *lru_first, *lru_last;
+	unsigned long nr_blocks, max_blocks;
+	unsigned long hits, misses, writebacks;
+};
+
+static int read_block_uncached(struct defrag_ctx *c, void *buf, blk64_t block)
+{
+	long long ret;
+	ret = pread64(c->fd, buf, EXT2_BLOCK_SIZE(&c->sb),
+	              block * EXT2_BLOCK_SIZE(&c->sb));
+	if (ret < EXT2_BLOCK_SIZE(&c->sb)) {
+		if (ret < 0)
+			printf("Cannot read block %llu (block_size %d)\n",
+			       block, EXT2_BLOCK_SIZE(&c->sb));
+		return -1;
+	}
+	return 0;
+}
+
+static int write_block_uncached(struct defrag_ctx *c, void *buf,
+                                blk64_t block)
+{
+	long long ret;
+	ret = pwrite64(c->fd, buf, EXT2_BLOCK_SIZE(&c->sb),
+	               block * EXT2_BLOCK_SIZE(&c->sb));
+	if (ret < EXT2_BLOCK_SIZE(&c->sb)) {
+		if (ret < 0)
+			printf("Cannot write block %llu (block_size %d)\n",
+			       block, EXT2_BLOCK_SIZE(&c->sb));
+		return -1;
+	}
+	return 0;
+}
+
+static inline struct cache_block **hash_slot(struct block_cache *cache,
+                                             blk64_t block)
+{
+	return &cache->hash[(block * 0x9E3779B97F4A7C15ULL >> 32)
+	                    & cache->hash_mask];
+}
+
+static struct cache_block *lookup_block(struct block_cache *cache,
+                                        blk64_t block)
+{
+	struct cache_block *b = *hash_slot(cache, block);
+	while (b && b->block != block)
+		b = b->hash_next;
+	return b;
+}
+
+static void lru_unlink(struct block_cache *cache, struct cache_block *b)
+{
+	if (b->lru_prev)
+		b->lru_prev->lru_next = b->lru_next;
+	else
+		cache->lru_first = b->lru_next;
+	if (b->lru_next)
+		b->lru_next->lru_prev = b->lru_prev;
+	else
+		cache->lru_last = b->lru_prev;
+}
+
+static void lru_push_front(struct block_cache *cache, struct cache_block *b)
+{
+	b->lru_prev = NULL;
+	b->lru_next = cache->lru_first;
+	if (cache->lru_first)
+		cache->lru_first->lru_prev = b;
+	else
+		cache->lru_last = b;
+	cache->lru_first = b;
+}
+
+static void hash_unlink(struct block_cache *cache, struct cache_block *b)
+{
+	struct cache_block **p = hash_slot(cache, b->block);
+	while (*p != b)
+		p = &(*p)->hash_next;
+	*p = b->hash_next;
+}
+
+/* Drops a block from the cache without writing it back */
+static void forget_block(struct block_cache *cache, struct cache_block *b)
+{
+	hash_unlink(cache, b);
+	lru_unlink(cache, b);
+	cache->nr_blocks--;
+	free(b);
+}
+
+static int writeback_block(struct defrag_ctx *c, struct cache_block *b)
+{
+	int ret;
+	ret = write_block_uncached(c, b->data, b->block);
+	if (!ret) {
+		b->dirty = 0;
+		c->cache->writebacks++;
+	}
+	return ret;
+}
+
+/* Returns a new entry for block, evicting the least recently used one if the
+ * cache is full. The contents of the returned block are undefined.
+ */
+static struct cache_block *insert_block(struct defrag_ctx *c, blk64_t block)
+{
+	struct block_cache *cache = c->cache;
+	struct cache_block *b, **slot;
+
+	if (cache->nr_blocks >= cache->max_blocks) {
+		b = cache->lru_last;
+		if (b->dirty && writeback_block(c, b))
+			return NULL;
+		hash_unlink(cache, b);
+		lru_unlink(cache, b);
+	} else {
+		b = malloc(sizeof(*b) + EXT2_BLOCK_SIZE(&c->sb));
+		if (!b)
+			return NULL;
+		cache->nr_blocks++;
+	}
+	b->block = block;
+	b->dirty = 0;
+	slot = hash_slot(cache, block);
+	b->hash_next = *slot;
+	*slot = b;
+	lru_push_front(cache, b);
+	return b;
+}
+
+/* The disk is read without holding the lock, so that threads reading other
+ * blocks are not held up. A copy that was cached or written back meanwhile
+ * is newer than what was read, so it wins.
+ */
+int read_block(struct defrag_ctx *c, void *buf, blk64_t block)
+{
+	struct block_cache *cache = c->cache;
+	struct cache_block *b;
+	unsigned long writebacks;
+	int ret = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	do {
+		b = lookup_block(cache, block);
+		if (b) {
+			cache->hits++;
+			lru_unlink(cache, b);
+			lru_push_front(cache, b);
+			memcpy(buf, b->data, EXT2_BLOCK_SIZE(&c->sb));
+			goto out;
+		}
+		cache->misses++;
+		writebacks = cache->writebacks;
+		pthread_mutex_unlock(&cache->lock);
+		ret = read_block_uncached(c, buf, block);
+		pthread_mutex_lock(&cache->lock);
+		if (ret)
+			goto out;
+		/* The read may have raced with a write-back of this block */
+	} while (writebacks != cache->writebacks
+	         || lookup_block(cache, block));
+	b = insert_block(c, block);
+	if (b)
+		memcpy(b->data, buf, EXT2_BLOCK_SIZE(&c->sb));
+out:
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+int write_block(struct defrag_ctx *c, void *buf, blk64_t block)
+{
+	struct block_cache *cache = c->cache;
+	struct cache_block *b;
+	int ret = 0;
+
+	if (global_settings.simulate)
+		return 0;
+	pthread_mutex_lock(&cache->lock);
+	b = lookup_block(cache, block);
+	if (b) {
+		lru_unlink(cache, b);
+		lru_push_front(cache, b);
+	} else {
+		b = insert_block(c, block);
+	}
+	if (b) {
+		memcpy(b->data, buf, EXT2_BLOCK_SIZE(&c->sb));
+		b->dirty = 1;
+	} else {
+		ret = write_block_uncached(c, buf, block);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+/* Replaces the blocks of a batch read straight from disk by their cached
+ * versions, which may be newer.
+ */
+void cache_overlay_blocks(struct defrag_ctx *c, void *buf,
+                          const blk64_t *blocks, int count)
+{
+	struct block_cache *cache = c->cache;
+	const int block_size = EXT2_BLOCK_SIZE(&c->sb);
+	int i;
+
+	pthread_mutex_lock(&cache->lock);
+	for (i = 0; i < count && cache->nr_blocks; i++) {
+		struct cache_block *b;
+		if (!blocks[i])
+			continue;
+		b = lookup_block(cache, blocks[i]);
+		if (b) {
+			cache->hits++;
+			memcpy((char *)buf + i * block_size, b->data,
+			       block_size);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Writes back all dirty blocks in [start, start + count). A range shorter
+ * than the cache is looked up block by block, so that moving a small extent
+ * does not walk every cached block.
+ */
+int cache_flush_range(struct defrag_ctx *c, blk64_t start, e2_blkcnt_t count)
+{
+	struct block_cache *cache = c->cache;
+	struct cache_block *b;
+	blk64_t block;
+	int ret = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	if (count <= cache->nr_blocks) {
+		for (block = start; block - start < count && !ret; block++) {
+			b = lookup_block(cache, block);
+			if (b && b->dirty)
+				ret = writeback_block(c, b);
+		}
+	} else {
+		for (b = cache->lru_first; b && !ret; b = b->lru_next) {
+			if (b->dirty && b->block >= start
+			    && b->block - start < count)
+				ret = writeback_block(c, b);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+int cache_flush(struct defrag_ctx *c)
+{
+	return cache_flush_range(c, 0, ~0ULL);
+}
+
+/* Drops all blocks in [start, start + count), for use when the on-disk
+ * contents were changed behind the cache's back. Like cache_flush_range(),
+ * a short range is looked up block by block.
+ */
+void cache_invalidate_range(struct defrag_ctx *c, blk64_t start,
+                            e2_blkcnt_t count)
+{
+	struct block_cache *cache = c->cache;
+	struct cache_block *b, *next;
+	blk64_t block;
+
+	pthread_mutex_lock(&cache->lock);
+	if (count <= cache->nr_blocks) {
+		for (block = start; block - start < count; block++) {
+			b = lookup_block(cache, block);
+			if (b)
+				forget_block(cache, b);
+		}
+	} else {
+		for (b = cache->lru_first; b; b = next) {
+			next = b->lru_next;
+			if (b->block >= start && b->block - start < count)
+				forget_block(cache, b);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Flushes the cache and waits for all written data to reach the disk */
+int cache_sync(struct defrag_ctx *c)
+{
+	int ret;
+	ret = cache_flush(c);
+	if (ret)
+		return ret;
+	return fdatasync(c->fd);
+}
+
+int cache_init(struct defrag_ctx *c, unsigned long max_blocks)
+{
+	struct block_cache *cache;
+	unsigned long hash_size = 1;
+
+	while (hash_size < 2 * max_blocks)
+		hash_size <<= 1;
+	cache = calloc(sizeof(*cache), 1);
+	if (!cache)
+		return -1;
+	cache->hash = calloc(sizeof(*cache->hash), hash_size);
+	if (!cache->hash) {
+		free(cache);
+		return -1;
+	}
+	cache->hash_mask = hash_size - 1;
+	cache->max_blocks = max_blocks;
+	pthread_mutex_init(&cache->lock, NULL);
+	c->cache = cache;
+	return 0;
+}
+
+int cache_destroy(struct defrag_ctx *c)
+{
+	struct block_cache *cache = c->cache;
+	int ret;
+
+	ret = cache_flush(c);
+#ifndef NDEBUG
+	printf("Block cache: %lu hits, %lu misses, %lu writebacks\n",
+	       cache->hits, cache->misses, cache->writebacks);
+#endif
+	while (cache->lru_first)
+		forget_block(cache, cache->lru_first);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->hash);
+	free(cache);
+	c->cache = NULL;
+	return ret;
+}
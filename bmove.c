@@ -24,12 +24,88 @@
 #include <errno.h>
 #include <sys/mman.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "e2defrag.h"
 #include "extree.h"
 
 static const size_t copy_buffer_size = 65536;
 
+/* Copies queued while a copy queue is active are split in pieces of at
+   most this many bytes, so that big extents are spread over the workers */
+#define COPY_CHUNK_SIZE (1024 * 1024)
+
+enum copy_state { COPY_FREE, COPY_QUEUED, COPY_BUSY };
+
+struct copy_request {
+	blk64_t from, to;
+	size_t nr_blocks;
+	enum copy_state state;
+};
+
+/* Copies in flight on several worker threads. A copy is only queued once
+ * no copy in flight reads or writes the blocks it writes, or writes the
+ * blocks it reads; otherwise it waits for those to finish first.
+ */
+struct copy_queue {
+	struct defrag_ctx *c;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	struct copy_request requests[MAX_IO_DEPTH];
+	int depth;
+	int nr_in_flight;
+	int stop;
+	int error;
+	int nr_workers;
+	pthread_t workers[MAX_IO_DEPTH];
+};
+
+static int __move_block_range(struct defrag_ctx *c, blk64_t from, blk64_t to,
+                              size_t nr_blocks);
+
+static int ranges_overlap(blk64_t a, size_t nr_a, blk64_t b, size_t nr_b)
+{
+	return a < b + nr_b && b < a + nr_a;
+}
+
+/* Reads count bytes at offset, short only at the end of the disk, so that a
+ * piece is read completely before any of it is written back.
+ */
+static ssize_t pread_full(int fd, void *buf, size_t count, off_t offset)
+{
+	size_t done = 0;
+
+	while (done < count) {
+		ssize_t ret = pread(fd, (char *)buf + done, count - done,
+		                    offset + done);
+		if (ret < 0)
+			return -1;
+		if (!ret)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+/* Moves a range up to a target that overlaps it, like memmove(). The end is
+ * moved first, in pieces of the size of the copy buffer. Each piece is read
+ * completely before it is written, so it may overlap its own target.
+ */
+static int move_block_range_up(struct defrag_ctx *c, blk64_t from,
+                               blk64_t to, size_t nr_blocks)
+{
+	size_t step = copy_buffer_size / EXT2_BLOCK_SIZE(&c->sb);
+
+	while (nr_blocks > 0) {
+		size_t n = nr_blocks < step ? nr_blocks : step;
+		nr_blocks -= n;
+		if (__move_block_range(c, from + nr_blocks, to + nr_blocks, n))
+			return -1;
+	}
+	return 0;
+}
+
 #ifndef NOSPLICE
 static int __move_block_range_nosplice(struct defrag_ctx *c, blk64_t from,
                                        blk64_t to, size_t nr_blocks)
@@ -45,6 +121,11 @@ static int __move_block_range(struct defrag_ctx *c, blk64_t from, blk64_t to,
 
 	if (global_settings.simulate || global_settings.no_data_move)
 		return 0;
+	/* Moving down, every chunk is read before it is overwritten. Moving
+	   up, only a range that fits the buffer is read before writing */
+	if (to > from && to < from + nr_blocks
+	    && nr_blocks * EXT2_BLOCK_SIZE(&c->sb) > copy_buffer_size)
+		return move_block_range_up(c, from, to, nr_blocks);
 	if (!copy_buffer || copy_buffer == MAP_FAILED) {
 		copy_buffer = mmap(NULL, copy_buffer_size,
 		                   PROT_READ | PROT_WRITE,
@@ -58,11 +139,8 @@ static int __move_block_range(struct defrag_ctx *c, blk64_t from, blk64_t to,
 	posix_fadvise(c->fd, from_offset, size, POSIX_FADV_WILLNEED);
 	while (size > 0) {
 		ssize_t to_write;
-		tmp = lseek(c->fd, from_offset, SEEK_SET);
-		if (tmp == (off_t) -1)
-			return -1;
 		to_write = size > copy_buffer_size ? copy_buffer_size : size;
-		ret = read(c->fd, copy_buffer, to_write);
+		ret = pread_full(c->fd, copy_buffer, to_write, from_offset);
 		if (ret <= 0)
 			return ret;
 
@@ -102,7 +180,8 @@ static int __move_block_range(struct defrag_ctx *c, blk64_t from, blk64_t to,
 
 	if (global_settings.simulate || global_settings.no_data_move)
 		return 0;
-	if (!has_splice)
+	/* The pipe may still refer to source pages that are overwritten */
+	if (!has_splice || ranges_overlap(from, nr_blocks, to, nr_blocks))
 		return __move_block_range_nosplice(c, from, to, nr_blocks);
 
 	if (transfer_pipe[0] < 0) {
@@ -143,60 +222,360 @@ static int __move_block_range(struct defrag_ctx *c, blk64_t from, blk64_t to,
 }
 #endif /* NOSPLICE */
 
-/* Target must have exactly one extent (for now) and exactly as many blocks
-   as the source extent. Target is no longer valid afterwards and must be
-   cleaned up by the caller. */
-int move_data_extent(struct defrag_ctx *c, struct data_extent *extent_to_copy,
-                     struct allocation *target)
+static int copy_with_buffer(struct defrag_ctx *c, unsigned char *buffer,
+                            blk64_t from, blk64_t to, size_t nr_blocks)
+{
+	off_t from_offset = from * EXT2_BLOCK_SIZE(&c->sb);
+	off_t to_offset = to * EXT2_BLOCK_SIZE(&c->sb);
+	ssize_t size = EXT2_BLOCK_SIZE(&c->sb) * nr_blocks;
+
+	while (size > 0) {
+		ssize_t done, to_write;
+		to_write = size > copy_buffer_size ? copy_buffer_size : size;
+		to_write = pread_full(c->fd, buffer, to_write, from_offset);
+		if (to_write <= 0) {
+			if (!to_write)
+				errno = EIO;
+			return -1;
+		}
+		size -= to_write;
+		from_offset += to_write;
+		while (to_write > 0) {
+			done = pwrite(c->fd, buffer, to_write, to_offset);
+			if (done <= 0) {
+				if (!done)
+					errno = EIO;
+				return -1;
+			}
+			to_write -= done;
+			to_offset += done;
+		}
+	}
+	return 0;
+}
+
+static void *copy_worker(void *arg)
+{
+	struct copy_queue *q = arg;
+	unsigned char *buffer = malloc(copy_buffer_size);
+
+	pthread_mutex_lock(&q->lock);
+	if (!buffer && !q->error)
+		q->error = ENOMEM;
+	while (buffer) {
+		struct copy_request *r = NULL;
+		int i, ret;
+		for (i = 0; i < q->depth && !r; i++)
+			if (q->requests[i].state == COPY_QUEUED)
+				r = &q->requests[i];
+		if (!r) {
+			if (q->stop)
+				break;
+			pthread_cond_wait(&q->changed, &q->lock);
+			continue;
+		}
+		r->state = COPY_BUSY;
+		pthread_mutex_unlock(&q->lock);
+		ret = copy_with_buffer(q->c, buffer, r->from, r->to,
+		                       r->nr_blocks);
+		pthread_mutex_lock(&q->lock);
+		if (ret && !q->error)
+			q->error = errno ? errno : EIO;
+		r->state = COPY_FREE;
+		q->nr_in_flight--;
+		pthread_cond_broadcast(&q->changed);
+	}
+	pthread_mutex_unlock(&q->lock);
+	free(buffer);
+	return NULL;
+}
+
+static int conflicts_in_flight(struct copy_queue *q, blk64_t from,
+                               blk64_t to, size_t nr_blocks)
+{
+	int i;
+
+	for (i = 0; i < q->depth; i++) {
+		struct copy_request *r = &q->requests[i];
+		if (r->state == COPY_FREE)
+			continue;
+		if (ranges_overlap(to, nr_blocks, r->from, r->nr_blocks)
+		    || ranges_overlap(to, nr_blocks, r->to, r->nr_blocks)
+		    || ranges_overlap(from, nr_blocks, r->to, r->nr_blocks))
+			return 1;
+	}
+	return 0;
+}
+
+/* Queues a copy once a worker is free and it does not depend on a copy
+ * still in flight.
+ */
+static int queue_copy(struct copy_queue *q, blk64_t from, blk64_t to,
+                      size_t nr_blocks)
+{
+	int i;
+
+	pthread_mutex_lock(&q->lock);
+	while (!q->error && (q->nr_in_flight == q->depth
+	                     || conflicts_in_flight(q, from, to, nr_blocks)))
+		pthread_cond_wait(&q->changed, &q->lock);
+	if (q->error) {
+		errno = q->error;
+		pthread_mutex_unlock(&q->lock);
+		return -1;
+	}
+	for (i = 0; q->requests[i].state != COPY_FREE; i++)
+		;
+	q->requests[i].from = from;
+	q->requests[i].to = to;
+	q->requests[i].nr_blocks = nr_blocks;
+	q->requests[i].state = COPY_QUEUED;
+	q->nr_in_flight++;
+	pthread_cond_broadcast(&q->changed);
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+/* Until copy_queue_end(), data copies are done by global_settings.io_depth
+ * threads at once, and only complete at copy_queue_end(). The caller must
+ * not rely on copied data or reuse the source blocks before then.
+ */
+int copy_queue_begin(struct defrag_ctx *c)
+{
+	struct copy_queue *q;
+	int i;
+
+	if (global_settings.io_depth <= 1 || global_settings.simulate
+	    || global_settings.no_data_move)
+		return 0;
+	q = calloc(sizeof(*q), 1);
+	if (!q)
+		return -1;
+	q->c = c;
+	q->depth = global_settings.io_depth;
+	if (q->depth > MAX_IO_DEPTH)
+		q->depth = MAX_IO_DEPTH;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->changed, NULL);
+	for (i = 0; i < q->depth; i++) {
+		if (pthread_create(&q->workers[i], NULL, copy_worker, q))
+			break;
+		q->nr_workers++;
+	}
+	c->copy_queue = q;
+	if (!q->nr_workers) {
+		copy_queue_end(c);
+		errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+/* Waits for all queued copies. Returns -1 if any of them failed. */
+int copy_queue_end(struct defrag_ctx *c)
+{
+	struct copy_queue *q = c->copy_queue;
+	int i, error;
+
+	if (!q)
+		return 0;
+	pthread_mutex_lock(&q->lock);
+	q->stop = 1;
+	pthread_cond_broadcast(&q->changed);
+	pthread_mutex_unlock(&q->lock);
+	for (i = 0; i < q->nr_workers; i++)
+		pthread_join(q->workers[i], NULL);
+	error = q->error;
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->changed);
+	free(q);
+	c->copy_queue = NULL;
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/* Waits until no copies are in flight, so that blocks may be written
+ * outside the queue. Returns -1 if any of them failed.
+ */
+int copy_queue_drain(struct defrag_ctx *c)
+{
+	struct copy_queue *q = c->copy_queue;
+	int error;
+
+	if (!q)
+		return 0;
+	pthread_mutex_lock(&q->lock);
+	while (q->nr_in_flight)
+		pthread_cond_wait(&q->changed, &q->lock);
+	error = q->error;
+	pthread_mutex_unlock(&q->lock);
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/* Copies blocks on disk, keeping the block cache coherent: dirty cached
+ * source blocks are written out first, and cached target blocks are dropped
+ * since their on-disk contents are replaced.
+ */
+static int move_block_range(struct defrag_ctx *c, blk64_t from, blk64_t to,
+                            size_t nr_blocks)
 {
-	struct inode *i = c->inodes[extent_to_copy->inode_nr];
-	blk64_t old_start;
-	e2_blkcnt_t blk_cnt;
 	int ret;
+	ret = cache_flush_range(c, from, nr_blocks);
+	if (ret)
+		return ret;
+	cache_invalidate_range(c, to, nr_blocks);
+	if (c->copy_queue) {
+		size_t chunk = COPY_CHUNK_SIZE / EXT2_BLOCK_SIZE(&c->sb);
+		size_t buffer = copy_buffer_size / EXT2_BLOCK_SIZE(&c->sb);
+		int up = to > from && to < from + nr_blocks;
+		/* Moving up over itself, the end must be copied first. A
+		   piece overlapping its own target must fit the buffer */
+		if (up && chunk > to - from)
+			chunk = to - from > buffer ? to - from : buffer;
+		while (nr_blocks) {
+			size_t n = nr_blocks < chunk ? nr_blocks : chunk;
+			blk64_t offset = up ? nr_blocks - n : 0;
+			if (queue_copy(c->copy_queue, from + offset,
+			               to + offset, n) < 0)
+				return -1;
+			if (!up) {
+				from += n;
+				to += n;
+			}
+			nr_blocks -= n;
+		}
+		return 0;
+	}
+	return __move_block_range(c, from, to, nr_blocks);
+}
+
+/* Checks that target can take the extent and copies its data there */
+static int copy_data_extent(struct defrag_ctx *c, struct data_extent *extent,
+                            struct allocation *target)
+{
+	e2_blkcnt_t blk_cnt = extent->end_block - extent->start_block + 1;
 
 	if (target->extent_count > 1) {
 		errno = ENOSYS;
 		return -1;
 	}
-	blk_cnt = extent_to_copy->end_block - extent_to_copy->start_block + 1;
 	if (blk_cnt != target->extents[0].end_block -
 	               target->extents[0].start_block + 1)
 	{
 		errno = EINVAL;
 		return -1;
 	}
-	if (!extent_to_copy->uninit) {
-		ret = __move_block_range(c, extent_to_copy->start_block,
-	                                 target->extents[0].start_block,
-		                         blk_cnt);
-	} else {
-		ret = 0;
+	if (extent->uninit)
+		return 0;
+	return move_block_range(c, extent->start_block,
+	                        target->extents[0].start_block, blk_cnt);
+}
+
+/* Points the extent at the target in the model. The old blocks the target
+   does not cover are returned in *free_start and *free_count, but they are
+   not freed yet. */
+static void relocate_data_extent(struct defrag_ctx *c,
+                                 struct data_extent *extent,
+                                 struct allocation *target,
+                                 blk64_t *free_start, e2_blkcnt_t *free_count)
+{
+	blk64_t old_start = extent->start_block;
+	blk64_t new_start = target->extents[0].start_block;
+	e2_blkcnt_t blk_cnt = extent->end_block - extent->start_block + 1;
+
+	*free_start = old_start;
+	*free_count = blk_cnt;
+	if (new_start < old_start && new_start + blk_cnt > old_start) {
+		*free_start = new_start + blk_cnt;
+		*free_count = old_start - new_start;
+	} else if (new_start > old_start && new_start < old_start + blk_cnt) {
+		*free_count = new_start - old_start;
+	}
+	rb_remove_data_extent(c, extent);
+	*extent = target->extents[0];
+	insert_data_extent(c, extent);
+}
+
+static int merge_moved_extent(struct defrag_ctx *c, struct inode *inode,
+                              struct data_extent *extent)
+{
+	int ret = try_extent_merge(c, inode, extent);
+	if (!ret) {
+		remove_data_extent_by_block(c, extent);
+		insert_data_extent_by_block(c, extent);
+		/* Extent size has not changed */
+	}
+	return ret;
+}
+
+/* Target must have exactly one extent (for now) and exactly as many blocks
+   as the source extent. It may overlap the source extent. Target is no
+   longer valid afterwards and must be cleaned up by the caller. The data is
+   on disk before the metadata points at it, so this cannot be used while a
+   copy queue is active. */
+int move_data_extent(struct defrag_ctx *c, struct data_extent *extent_to_copy,
+                     struct allocation *target)
+{
+	struct inode *i = get_inode(c, extent_to_copy->inode_nr);
+	blk64_t free_start;
+	e2_blkcnt_t free_count;
+	int ret;
+
+	if (c->copy_queue) {
+		errno = EBUSY;
+		return -1;
 	}
+	/* The chunks of a big extent are copied by several threads */
+	ret = 0;
+	if ((extent_to_copy->end_block - extent_to_copy->start_block + 1)
+	    * EXT2_BLOCK_SIZE(&c->sb) > COPY_CHUNK_SIZE)
+		ret = copy_queue_begin(c);
+	if (!ret)
+		ret = copy_data_extent(c, extent_to_copy, target);
+	if (copy_queue_end(c) < 0)
+		ret = -1;
 	if (!ret)
-		ret = fdatasync(c->fd);
+		ret = cache_sync(c);
 	if (ret)
 		return ret;
-	old_start = extent_to_copy->start_block;
-	rb_remove_data_extent(c, extent_to_copy);
-	*extent_to_copy = target->extents[0];
-	insert_data_extent(c, extent_to_copy);
+	relocate_data_extent(c, extent_to_copy, target, &free_start,
+	                     &free_count);
 	ret = write_extent_metadata(c, extent_to_copy);
-	if (!ret) {
-		ret = deallocate_space(c, old_start, blk_cnt);
-		if (!ret) {
-			ret = try_extent_merge(c, i, extent_to_copy);
-			if (!ret) {
-				rb_erase(&extent_to_copy->block_rb,
-				         &c->extents_by_block);
-				insert_data_extent_by_block(c, extent_to_copy);
-				/* Extent size has not changed */
-			}
-			return ret;
-		}
-	}
+	if (!ret)
+		ret = deallocate_space(c, free_start, free_count);
+	if (!ret)
+		ret = merge_moved_extent(c, i, extent_to_copy);
 	return ret;
 }
 
+/* Like move_data_extent(), but only updates the model: the copy may still
+   be in flight on the copy queue, and neither the inode's metadata nor the
+   old blocks are touched. Once the copy is done, the caller must sync, call
+   write_inode_metadata() and only then free the old blocks returned in
+   *free_start and *free_count. */
+int move_data_extent_deferred(struct defrag_ctx *c,
+                              struct data_extent *extent_to_copy,
+                              struct allocation *target,
+                              blk64_t *free_start, e2_blkcnt_t *free_count)
+{
+	struct inode *i = get_inode(c, extent_to_copy->inode_nr);
+	int ret;
+
+	ret = copy_data_extent(c, extent_to_copy, target);
+	if (ret)
+		return ret;
+	relocate_data_extent(c, extent_to_copy, target, free_start,
+	                     free_count);
+	return merge_moved_extent(c, i, extent_to_copy);
+}
+
 /* Copy the given allocation to a new position on disk. Overlap between the
  * origin and target is allowed only for regions that are not moved at all.
  * This method may realloc *ret_target should an extent need to be split.
@@ -235,7 +614,7 @@ int copy_data(struct defrag_ctx *c, struct allocation *from,
 		}
 		if (from_extent->uninit != to_extent->uninit) {
 			struct allocation *new_target;
-			struct inode *inode = c->inodes[to_extent->inode_nr];
+			struct inode *inode = get_inode(c, to_extent->inode_nr);
 			blk64_t new_start_logical;
 			int extent_nr = to_extent - target->extents;
 			new_start_logical = get_logical_block(inode, cur_from);
@@ -254,8 +633,8 @@ int copy_data(struct defrag_ctx *c, struct allocation *from,
 			num_blocks = to_extent->end_block - cur_dest + 1;
 
 		if (!to_extent->uninit && cur_from != cur_dest) {
-			ret = __move_block_range(c, cur_from, cur_dest,
-			                                            num_blocks);
+			ret = move_block_range(c, cur_from, cur_dest,
+			                                          num_blocks);
 			if (ret)
 				return ret;
 		}
@@ -0,0 +1,306 @@
+/*
+    Copyright 2009 Enno Ruijters
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of version 2 of the GNU General
+    Public License as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <string.h>
+#include "btree.h"
+
+/* Every node but the root has at least this many entries */
+#define BTREE_MIN (BTREE_ORDER / 2)
+
+static struct btree_node *new_node(struct btree *t, int leaf)
+{
+	struct btree_node *n = slab_alloc(&t->nodes);
+	if (!n) {
+		t->broken = 1;
+		return NULL;
+	}
+	n->nr = 0;
+	n->leaf = leaf;
+	n->prev = n->next = NULL;
+	return n;
+}
+
+/* Index of the child of an inner node whose subtree may contain key */
+static int child_index(const struct btree_node *n, uint64_t key)
+{
+	int low = 1, high = n->nr;
+
+	/* keys[0] does not bound anything from below, so it is skipped */
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (n->keys[mid] <= key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low - 1;
+}
+
+/* Index of the first key in a leaf that is not smaller than key */
+static int leaf_index(const struct btree_node *n, uint64_t key)
+{
+	int low = 0, high = n->nr;
+
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (n->keys[mid] < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+static void insert_at(struct btree_node *n, int pos, uint64_t key, void *ptr)
+{
+	memmove(&n->keys[pos + 1], &n->keys[pos],
+	        (n->nr - pos) * sizeof(n->keys[0]));
+	memmove(&n->ptrs[pos + 1], &n->ptrs[pos],
+	        (n->nr - pos) * sizeof(n->ptrs[0]));
+	n->keys[pos] = key;
+	n->ptrs[pos] = ptr;
+	n->nr++;
+}
+
+static void remove_at(struct btree_node *n, int pos)
+{
+	n->nr--;
+	memmove(&n->keys[pos], &n->keys[pos + 1],
+	        (n->nr - pos) * sizeof(n->keys[0]));
+	memmove(&n->ptrs[pos], &n->ptrs[pos + 1],
+	        (n->nr - pos) * sizeof(n->ptrs[0]));
+}
+
+/* Moves the upper half of an overflowing node to a new right sibling */
+static struct btree_node *split(struct btree *t, struct btree_node *n)
+{
+	struct btree_node *right = new_node(t, n->leaf);
+	int half = n->nr / 2;
+
+	if (!right)
+		return NULL;
+	right->nr = n->nr - half;
+	memcpy(right->keys, &n->keys[half], right->nr * sizeof(n->keys[0]));
+	memcpy(right->ptrs, &n->ptrs[half], right->nr * sizeof(n->ptrs[0]));
+	n->nr = half;
+	if (n->leaf) {
+		right->prev = n;
+		right->next = n->next;
+		if (n->next)
+			n->next->prev = right;
+		n->next = right;
+	}
+	return right;
+}
+
+/* Returns the new right sibling of n if it had to be split */
+static struct btree_node *insert_rec(struct btree *t, struct btree_node *n,
+                                     uint64_t key, void *value)
+{
+	int i;
+
+	if (n->leaf) {
+		i = leaf_index(n, key);
+		if (i < n->nr && n->keys[i] == key) {
+			n->ptrs[i] = value;
+			return NULL;
+		}
+		insert_at(n, i, key, value);
+	} else {
+		struct btree_node *right;
+		i = child_index(n, key);
+		right = insert_rec(t, n->ptrs[i], key, value);
+		if (!right)
+			return NULL;
+		insert_at(n, i + 1, right->keys[0], right);
+	}
+	if (n->nr <= BTREE_ORDER)
+		return NULL;
+	return split(t, n);
+}
+
+/* Adds the entries of child j + 1 of n to child j */
+static void merge(struct btree *t, struct btree_node *n, int j)
+{
+	struct btree_node *left = n->ptrs[j], *right = n->ptrs[j + 1];
+
+	if (!left->leaf)
+		right->keys[0] = n->keys[j + 1];
+	memcpy(&left->keys[left->nr], right->keys,
+	       right->nr * sizeof(right->keys[0]));
+	memcpy(&left->ptrs[left->nr], right->ptrs,
+	       right->nr * sizeof(right->ptrs[0]));
+	left->nr += right->nr;
+	if (left->leaf) {
+		left->next = right->next;
+		if (right->next)
+			right->next->prev = left;
+	}
+	remove_at(n, j + 1);
+	slab_free(&t->nodes, right);
+}
+
+/* Refills child i of n, which has too few entries, from a sibling */
+static void rebalance(struct btree *t, struct btree_node *n, int i)
+{
+	struct btree_node *child = n->ptrs[i];
+	struct btree_node *left = i > 0 ? n->ptrs[i - 1] : NULL;
+	struct btree_node *right = i + 1 < n->nr ? n->ptrs[i + 1] : NULL;
+
+	if (left && left->nr > BTREE_MIN) {
+		int last = left->nr - 1;
+		if (!child->leaf)
+			child->keys[0] = n->keys[i];
+		insert_at(child, 0, left->keys[last], left->ptrs[last]);
+		n->keys[i] = left->keys[last];
+		left->nr--;
+	} else if (right && right->nr > BTREE_MIN) {
+		if (child->leaf) {
+			insert_at(child, child->nr, right->keys[0],
+			          right->ptrs[0]);
+			remove_at(right, 0);
+			n->keys[i + 1] = right->keys[0];
+		} else {
+			insert_at(child, child->nr, n->keys[i + 1],
+			          right->ptrs[0]);
+			n->keys[i + 1] = right->keys[1];
+			remove_at(right, 0);
+		}
+	} else if (left) {
+		merge(t, n, i - 1);
+	} else {
+		merge(t, n, i);
+	}
+}
+
+/* Returns whether n has too few entries left */
+static int remove_rec(struct btree *t, struct btree_node *n, uint64_t key)
+{
+	int i;
+
+	if (n->leaf) {
+		i = leaf_index(n, key);
+		if (i == n->nr || n->keys[i] != key)
+			return 0;
+		remove_at(n, i);
+	} else {
+		i = child_index(n, key);
+		if (remove_rec(t, n->ptrs[i], key))
+			rebalance(t, n, i);
+	}
+	return n->nr < BTREE_MIN;
+}
+
+static struct btree_node *find_leaf(const struct btree *t, uint64_t key)
+{
+	struct btree_node *n = t->root;
+	while (n && !n->leaf)
+		n = n->ptrs[child_index(n, key)];
+	return n;
+}
+
+void btree_init(struct btree *t)
+{
+	slab_init_aligned(&t->nodes, sizeof(struct btree_node),
+	                  BTREE_CACHE_LINE);
+	t->root = NULL;
+	t->broken = 0;
+}
+
+/* Adds key to the tree, or replaces its value if it is already present */
+int btree_insert(struct btree *t, uint64_t key, void *value)
+{
+	struct btree_node *right, *root;
+
+	if (t->broken)
+		return -1;
+	if (!t->root) {
+		t->root = new_node(t, 1);
+		if (!t->root)
+			return -1;
+	}
+	right = insert_rec(t, t->root, key, value);
+	if (t->broken)
+		return -1;
+	if (right) {
+		root = new_node(t, 0);
+		if (!root)
+			return -1;
+		root->nr = 2;
+		root->keys[0] = t->root->keys[0];
+		root->ptrs[0] = t->root;
+		root->keys[1] = right->keys[0];
+		root->ptrs[1] = right;
+		t->root = root;
+	}
+	return 0;
+}
+
+void btree_remove(struct btree *t, uint64_t key)
+{
+	struct btree_node *root = t->root;
+
+	if (t->broken || !root)
+		return;
+	remove_rec(t, root, key);
+	if (!root->leaf && root->nr == 1) {
+		t->root = root->ptrs[0];
+		slab_free(&t->nodes, root);
+	} else if (root->leaf && root->nr == 0) {
+		t->root = NULL;
+		slab_free(&t->nodes, root);
+	}
+}
+
+/* Returns the value of the biggest key not above key */
+void *btree_floor(const struct btree *t, uint64_t key)
+{
+	struct btree_node *n = find_leaf(t, key);
+	int i;
+
+	if (!n)
+		return NULL;
+	i = leaf_index(n, key);
+	if (i < n->nr && n->keys[i] == key)
+		return n->ptrs[i];
+	if (i > 0)
+		return n->ptrs[i - 1];
+	/* The separator that led here may be below the smallest key left */
+	n = n->prev;
+	return n ? n->ptrs[n->nr - 1] : NULL;
+}
+
+/* Returns the value of the smallest key not below key */
+void *btree_ceil(const struct btree *t, uint64_t key)
+{
+	struct btree_node *n = find_leaf(t, key);
+	int i;
+
+	if (!n)
+		return NULL;
+	i = leaf_index(n, key);
+	if (i < n->nr)
+		return n->ptrs[i];
+	n = n->next;
+	return n ? n->ptrs[0] : NULL;
+}
+
+void btree_destroy(struct btree *t)
+{
+	slab_destroy(&t->nodes);
+	t->root = NULL;
+}
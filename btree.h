@@ -0,0 +1,59 @@
+/*
+    Copyright 2009 Enno Ruijters
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of version 2 of the GNU General
+    Public License as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __BTREE_H
+#define __BTREE_H
+
+#include <stdint.h>
+#include "slab.h"
+
+/* B+tree mapping unique 64-bit keys to pointers. The keys of a node are
+ * kept in their own array, which starts on a cache line and fills exactly
+ * BTREE_KEY_LINES of them, so a binary search within a node only touches
+ * those lines. The leaves are linked to make neighbour lookups cheap.
+ */
+#define BTREE_CACHE_LINE 64
+#define BTREE_KEY_LINES 2
+/* One key slot is kept free for overflowing before a split */
+#define BTREE_ORDER \
+	((int)(BTREE_KEY_LINES * BTREE_CACHE_LINE / sizeof(uint64_t)) - 1)
+
+struct btree_node {
+	/* In inner nodes keys[i] is a lower bound for the keys under ptrs[i] */
+	uint64_t keys[BTREE_ORDER + 1]
+		__attribute__((aligned(BTREE_CACHE_LINE)));
+	void *ptrs[BTREE_ORDER + 1];
+	int nr; /* keys in a leaf, children in an inner node */
+	int leaf;
+	struct btree_node *prev, *next; /* leaves only */
+};
+
+struct btree {
+	struct btree_node *root;
+	struct slab nodes;
+	/* Set if a node could not be allocated; the tree is useless then */
+	int broken;
+};
+
+void btree_init(struct btree *t);
+int btree_insert(struct btree *t, uint64_t key, void *value);
+void btree_remove(struct btree *t, uint64_t key);
+void *btree_floor(const struct btree *t, uint64_t key);
+void *btree_ceil(const struct btree *t, uint64_t key);
+void btree_destroy(struct btree *t);
+
+#endif
@@ -25,14 +25,79 @@
 struct settings global_settings = {
 	.simulate = 0,
 	.interactive = 0,
+	.nr_threads = 1,
+	.io_depth = 1,
 };
 
 void usage(int retval)
 {
-	printf("Usage: e2defrag [-s|--simulate] [-i|--interactive] [-d|--no-data-move] [--] <disk>\n");
+	printf("Usage: e2defrag [-s|--simulate] [-i|--interactive] [-d|--no-data-move] [-t|--threads <n>] [-q|--io-depth <n>] [--state-file <file>] [-n|--inode <nr>] [-m|--min-free-extent <blocks>] [--plan <file>|--run-plan <file>] [--compact] [--] <disk>\n");
+	printf("A thread count of 0 uses one thread per online processor.\n");
+	printf("With an I/O depth above 1, independent data copies overlap.\n");
+	printf("A state file speeds up later runs on the same disk.\n");
+	printf("With an inode number, only that inode is read and defragmented.\n");
+	printf("Smaller free extents are looked up in the bitmaps, not kept in memory.\n");
+	printf("A plan records the moves of a simulated run, to be run later.\n");
+	printf("Compaction slides all data toward the start of the disk.\n");
 	exit(retval);
 }
 
+int parse_thread_count(char *arg)
+{
+	char *endptr;
+	long count;
+
+	if (arg == NULL || *arg == '\0')
+		return EXIT_FAILURE;
+	count = strtol(arg, &endptr, 10);
+	if (*endptr != '\0' || count < 0 || count > MAX_THREADS)
+		return EXIT_FAILURE;
+	global_settings.nr_threads = count;
+	return 0;
+}
+
+int parse_io_depth(char *arg)
+{
+	char *endptr;
+	long depth;
+
+	if (arg == NULL || *arg == '\0')
+		return EXIT_FAILURE;
+	depth = strtol(arg, &endptr, 10);
+	if (*endptr != '\0' || depth < 1 || depth > MAX_IO_DEPTH)
+		return EXIT_FAILURE;
+	global_settings.io_depth = depth;
+	return 0;
+}
+
+int parse_inode_number(char *arg)
+{
+	char *endptr;
+	unsigned long nr;
+
+	if (arg == NULL || *arg == '\0')
+		return EXIT_FAILURE;
+	nr = strtoul(arg, &endptr, 10);
+	if (*endptr != '\0' || nr == 0 || nr > UINT32_MAX)
+		return EXIT_FAILURE;
+	global_settings.single_inode = nr;
+	return 0;
+}
+
+int parse_min_free_extent(char *arg)
+{
+	char *endptr;
+	unsigned long long blocks;
+
+	if (arg == NULL || *arg == '\0' || *arg == '-')
+		return EXIT_FAILURE;
+	blocks = strtoull(arg, &endptr, 10);
+	if (*endptr != '\0')
+		return EXIT_FAILURE;
+	global_settings.min_free_extent = blocks;
+	return 0;
+}
+
 int parse_long_option(int argc, char **argv, int *idx)
 {
 	if (strcmp(argv[*idx], "--simulate") == 0)
@@ -41,6 +106,23 @@ int parse_long_option(int argc, char **argv, int *idx)
 		global_settings.interactive = 1;
 	else if (strcmp(argv[*idx], "--no-data-move") == 0)
 		global_settings.no_data_move = 1;
+	else if (strcmp(argv[*idx], "--threads") == 0 && *idx + 1 < argc)
+		return parse_thread_count(argv[++(*idx)]);
+	else if (strcmp(argv[*idx], "--io-depth") == 0 && *idx + 1 < argc)
+		return parse_io_depth(argv[++(*idx)]);
+	else if (strcmp(argv[*idx], "--state-file") == 0 && *idx + 1 < argc)
+		global_settings.state_file = argv[++(*idx)];
+	else if (strcmp(argv[*idx], "--inode") == 0 && *idx + 1 < argc)
+		return parse_inode_number(argv[++(*idx)]);
+	else if (strcmp(argv[*idx], "--plan") == 0 && *idx + 1 < argc)
+		global_settings.plan_file = argv[++(*idx)];
+	else if (strcmp(argv[*idx], "--run-plan") == 0 && *idx + 1 < argc)
+		global_settings.run_plan_file = argv[++(*idx)];
+	else if (strcmp(argv[*idx], "--compact") == 0)
+		global_settings.compact = 1;
+	else if (strcmp(argv[*idx], "--min-free-extent") == 0
+	         && *idx + 1 < argc)
+		return parse_min_free_extent(argv[++(*idx)]);
 	else
 		return EXIT_FAILURE;
 	return 0;
@@ -65,6 +147,30 @@ int parse_options(int argc, char *argv[], char **filename)
 			case 'd':
 				global_settings.no_data_move = 1;
 				break;
+			case 't':
+				if (i + 1 >= argc)
+					return EXIT_FAILURE;
+				if (parse_thread_count(argv[++i]))
+					return EXIT_FAILURE;
+				break;
+			case 'q':
+				if (i + 1 >= argc)
+					return EXIT_FAILURE;
+				if (parse_io_depth(argv[++i]))
+					return EXIT_FAILURE;
+				break;
+			case 'n':
+				if (i + 1 >= argc)
+					return EXIT_FAILURE;
+				if (parse_inode_number(argv[++i]))
+					return EXIT_FAILURE;
+				break;
+			case 'm':
+				if (i + 1 >= argc)
+					return EXIT_FAILURE;
+				if (parse_min_free_extent(argv[++i]))
+					return EXIT_FAILURE;
+				break;
 			case '-':
 				if (argv[i][2] != '0') {
 					int ret;
@@ -95,6 +201,22 @@ int parse_options(int argc, char *argv[], char **filename)
 	}
 	if (*filename == NULL)
 		return EXIT_FAILURE;
+	/* Single inode mode only has the bitmaps of some groups */
+	if (global_settings.single_inode && (global_settings.min_free_extent > 1
+	                                     || global_settings.plan_file
+	                                     || global_settings.run_plan_file))
+		return EXIT_FAILURE;
+	if ((global_settings.plan_file || global_settings.run_plan_file)
+	    && (global_settings.interactive
+	        || (global_settings.plan_file && global_settings.run_plan_file)))
+		return EXIT_FAILURE;
+	if (global_settings.compact && (global_settings.interactive
+	                                || global_settings.single_inode
+	                                || global_settings.run_plan_file))
+		return EXIT_FAILURE;
+	/* A plan is made on the model only */
+	if (global_settings.plan_file)
+		global_settings.simulate = 1;
 	return 0;
 }
 
@@ -121,13 +243,46 @@ int main(int argc, char *argv[])
 #ifndef NDEBUG
 	dump_trees(disk, 3);
 #endif
+	if (global_settings.plan_file
+	    && plan_begin(disk, global_settings.plan_file) < 0) {
+		printf("Could not create plan %s: %s\n",
+		       global_settings.plan_file, strerror(errno));
+		return errno;
+	}
 	if (global_settings.interactive) {
 		ret = 0;
 		while (!ret)
 			ret = defrag_file_interactive(disk);
+	} else if (global_settings.single_inode) {
+		ret = do_single_inode(disk, global_settings.single_inode);
+	} else if (global_settings.run_plan_file) {
+		ret = run_plan(disk, global_settings.run_plan_file);
+		if (ret < 0)
+			printf("Could not run plan %s: %s\n",
+			       global_settings.run_plan_file, strerror(errno));
+	} else if (global_settings.compact) {
+		ret = do_compact(disk);
+		if (ret < 0)
+			printf("Compaction failed: %s\n", strerror(errno));
 	} else {
 		ret = do_whole_disk(disk);
 	}
+	if (global_settings.plan_file && ret < 0) {
+		printf("Planning failed: %s\n", strerror(errno));
+		plan_finish(disk);
+		unlink(global_settings.plan_file);
+	} else if (global_settings.plan_file && plan_finish(disk) < 0) {
+		printf("Could not write plan %s: %s\n",
+		       global_settings.plan_file, strerror(errno));
+	}
+	/* In single inode mode the model only covers part of the disk, and
+	   after an error it may not match what is on the disk */
+	if (global_settings.state_file && !global_settings.simulate
+	    && !global_settings.single_inode && ret >= 0) {
+		if (save_state(disk, global_settings.state_file) < 0)
+			printf("Could not save state file %s: %s\n",
+			       global_settings.state_file, strerror(errno));
+	}
 	close_drive(disk);
 	return 0;
 }
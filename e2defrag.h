@@ -22,6 +22,10 @@
 #include <ext2fs/ext3_extents.h>
 #include <stdint.h>
 #include "rbtree.h"
+#include "slab.h"
+#ifdef BTREE_INDEX
+#include "btree.h"
+#endif
 
 typedef __u64 blk64_t;
 typedef __u64 e2_blkcnt_t;
@@ -31,10 +35,40 @@ struct settings {
 	unsigned int simulate : 1;
 	unsigned int interactive : 1;
 	unsigned int no_data_move : 1;
+	unsigned int nr_threads;
+	unsigned int io_depth; /* data copies in flight at once */
+	const char *state_file;
+	ext2_ino_t single_inode;
+	/* Smaller free extents are only tracked in the block bitmaps */
+	e2_blkcnt_t min_free_extent;
+	const char *plan_file; /* the moves of a simulated run go here */
+	const char *run_plan_file;
+	unsigned int compact : 1; /* slide all data to the start of the disk */
 };
 
 extern struct settings global_settings;
 
+/* Whether a free extent of the given size is kept in the free space trees */
+static inline int free_extent_indexed(e2_blkcnt_t num_blocks)
+{
+	return num_blocks >= global_settings.min_free_extent;
+}
+
+/* Upper bound for the number of threads used while parsing the disk */
+#define MAX_THREADS 256
+
+/* Upper bound for the number of data copies in flight at once */
+#define MAX_IO_DEPTH 64
+
+/* Number of metadata blocks kept in the block cache */
+#define BLOCK_CACHE_SIZE 1024
+
+/* Number of inodes whose moves do_whole_disk() plans together */
+#define PLAN_BATCH 256
+
+/* Free extents of 2^k up to 2^(k+1) - 1 blocks are in size class k */
+#define FREE_SIZE_CLASSES 64
+
 #define SUPERBLOCK_OFFSET 1024
 #define SUPERBLOCK_SIZE 1024
 
@@ -81,6 +115,9 @@ struct data_extent {
 struct free_extent {
 	blk64_t start_block;
 	blk64_t end_block;
+	/* Size of the biggest extent in the subtree of block_rb */
+	e2_blkcnt_t max_subtree_size;
+	struct free_extent *class_prev, *class_next;
 	struct rb_node block_rb;
 	struct rb_node size_rb;
 };
@@ -108,12 +145,53 @@ struct inode {
 	int num_sparse;
 };
 
+/* Free space in one block group. Only the indexed free extents count, so
+   with a min_free_extent above 1 the smaller ones are left out. */
+struct group_free_summary {
+	e2_blkcnt_t free_blocks;
+	unsigned long nr_extents; /* free extents starting in the group */
+	/* Biggest free extent overlapping the group. Recomputed on demand
+	   if the biggest one went away. */
+	e2_blkcnt_t largest;
+	int largest_stale;
+};
+
+struct frag_queue_entry {
+	uint64_t score;
+	ext2_ino_t inode_nr;
+};
+
+/* Fragmented inodes by fragmentation score, see fragqueue.c */
+struct frag_queue {
+	struct frag_queue_entry *heap;
+	uint32_t nr;
+	/* Heap index + 1 of every inode, 0 if it is not queued */
+	uint32_t *pos;
+	/* Inodes that could not be improved with the current free space */
+	ext2_ino_t *stalled;
+	uint32_t nr_stalled;
+	/* Inodes whose metadata may be fragmented, and which are listed */
+	ext2_ino_t *changed;
+	uint32_t nr_changed;
+	char *is_changed;
+};
+
 struct defrag_ctx {
 	struct ext2_super_block sb;
 	struct rb_root extents_by_block;
 	struct rb_root extents_by_size;
 	struct rb_root free_tree_by_block;
 	struct rb_root free_tree_by_size;
+	/* Unordered lists of free extents per size class, and a bitmap of
+	   the non-empty ones */
+	struct free_extent *size_classes[FREE_SIZE_CLASSES];
+	uint64_t size_class_map;
+	struct group_free_summary *group_free;
+#ifdef BTREE_INDEX
+	/* Extents by start block, for the lookups by block in extree.h */
+	struct btree extents_index;
+	struct btree free_index;
+#endif
 	struct {
 		void *map_start;
 		unsigned char *bitmap;
@@ -126,9 +204,53 @@ struct defrag_ctx {
 	size_t map_length;
 	int nr_inode_maps;
 	int fd;
-	struct inode *inodes[];
+	struct block_cache *cache;
+	struct slab free_extent_slab;
+	struct slab inode_slab;
+	/* One table of inodes per group, allocated when first needed */
+	struct inode ***inode_tables;
+	/* Numbers of all known inodes, in ascending order */
+	ext2_ino_t *live_inodes;
+	ext2_ino_t nr_live_inodes;
+	/* Snapshot from a previous run, only present while parsing */
+	struct saved_state *state;
+	/* Single inode mode: free space is only known for scanned groups */
+	struct {
+		unsigned char *scanned; /* NULL if all groups are known */
+		int home_group;
+		int step;
+	} lazy;
+	/* Only set while do_whole_disk() runs */
+	struct frag_queue *frag_queue;
+	/* Only set while the decisions of the algorithm are recorded */
+	struct move_plan *plan;
+	/* Only set while data copies are done concurrently */
+	struct copy_queue *copy_queue;
 };
 
+static inline struct inode *get_inode(const struct defrag_ctx *c,
+                                      ext2_ino_t nr)
+{
+	struct inode **table;
+	if (nr == 0 || nr > c->sb.s_inodes_count)
+		return NULL;
+	nr--;
+	table = c->inode_tables[nr / EXT2_INODES_PER_GROUP(&c->sb)];
+	if (!table)
+		return NULL;
+	return table[nr % EXT2_INODES_PER_GROUP(&c->sb)];
+}
+
+/* Number of blocks in a flex group, or in a block group without flex_bg */
+static inline e2_blkcnt_t flex_bg_blocks(const struct defrag_ctx *c)
+{
+	e2_blkcnt_t flex_bg_size = 1;
+
+	if (EXT2_HAS_INCOMPAT_FEATURE(&c->sb, EXT4_FEATURE_INCOMPAT_FLEX_BG))
+		flex_bg_size = 1 << (c->sb.s_log_groups_per_flex);
+	return flex_bg_size * c->sb.s_blocks_per_group;
+}
+
 /* FUNCTION DECLARATIONS */
 
 /* algorithm.c */
@@ -136,6 +258,17 @@ int consolidate_free_space(struct defrag_ctx *c);
 int try_improve_inode(struct defrag_ctx *c, ext2_ino_t inode_nr);
 int do_one_inode(struct defrag_ctx *c, ext2_ino_t inode_nr);
 int do_whole_disk(struct defrag_ctx *c);
+int do_compact(struct defrag_ctx *c);
+int do_single_inode(struct defrag_ctx *c, ext2_ino_t inode_nr);
+uint64_t fragmentation_score(struct defrag_ctx *c, struct allocation *alloc);
+int move_extent(struct defrag_ctx *c, struct data_extent *data,
+                blk64_t new_start);
+int move_inode_data(struct defrag_ctx *c, ext2_ino_t inode_nr,
+                    struct allocation *target);
+int switch_inode_data(struct defrag_ctx *c, ext2_ino_t inode_nr,
+                      struct allocation *target);
+int move_extent_run(struct defrag_ctx *c, blk64_t from,
+                    e2_blkcnt_t nr_blocks, blk64_t to);
 
 /* allocation.c */
 struct allocation *copy_allocation(struct allocation *old);
@@ -149,33 +282,83 @@ struct allocation *split_extent(struct allocation *alloc,
                                 blk64_t new_start_logical);
 
 /* bitmap.c */
+unsigned long find_next_set_bit(const unsigned char *bitmap,
+                                unsigned long size, unsigned long offset);
+unsigned long find_next_zero_bit(const unsigned char *bitmap,
+                                 unsigned long size, unsigned long offset);
+int find_free_run(struct defrag_ctx *c, blk64_t block,
+                  blk64_t *start, blk64_t *end);
 void mark_blocks_unused(struct defrag_ctx *c, blk64_t first_block,
                         e2_blkcnt_t count);
 void mark_blocks_used(struct defrag_ctx *c, blk64_t first_block,
                       e2_blkcnt_t count);
 
+/* blockcache.c */
+int read_block(struct defrag_ctx *c, void *buf, blk64_t block);
+int write_block(struct defrag_ctx *c, void *buf, blk64_t block);
+void cache_overlay_blocks(struct defrag_ctx *c, void *buf,
+                          const blk64_t *blocks, int count);
+int cache_flush_range(struct defrag_ctx *c, blk64_t start, e2_blkcnt_t count);
+int cache_flush(struct defrag_ctx *c);
+void cache_invalidate_range(struct defrag_ctx *c, blk64_t start,
+                            e2_blkcnt_t count);
+int cache_sync(struct defrag_ctx *c);
+int cache_init(struct defrag_ctx *c, unsigned long max_blocks);
+int cache_destroy(struct defrag_ctx *c);
+
 /* bmove.c */
 int move_file_range(struct defrag_ctx *c, ext2_ino_t inode, blk64_t from,
                     e2_blkcnt_t numblocks, blk64_t dest);
 int move_data_extent(struct defrag_ctx *c, struct data_extent *extent_to_copy,
                      struct allocation *target);
+int move_data_extent_deferred(struct defrag_ctx *c,
+                              struct data_extent *extent_to_copy,
+                              struct allocation *target,
+                              blk64_t *free_start, e2_blkcnt_t *free_count);
 int copy_data(struct defrag_ctx *c, struct allocation *from,
               struct allocation **target);
+int copy_queue_begin(struct defrag_ctx *c);
+int copy_queue_end(struct defrag_ctx *c);
+int copy_queue_drain(struct defrag_ctx *c);
 
 /* debug.c */
 void dump_trees(struct defrag_ctx *c, int to_dump);
 
+/* fragqueue.c */
+int frag_queue_init(struct defrag_ctx *c, struct frag_queue *q);
+void frag_queue_destroy(struct defrag_ctx *c, struct frag_queue *q);
+ext2_ino_t frag_queue_pop(struct frag_queue *q);
+void frag_queue_stall(struct frag_queue *q, ext2_ino_t inode_nr);
+void frag_queue_retry(struct defrag_ctx *c, struct frag_queue *q);
+void frag_queue_update(struct defrag_ctx *c, ext2_ino_t inode_nr);
+
 /* freespace.c */
 int deallocate_space(struct defrag_ctx *c, blk64_t start, e2_blkcnt_t num);
 int deallocate_blocks(struct defrag_ctx *c, struct allocation *space);
 int allocate(struct defrag_ctx *c, struct allocation *space);
+int reserve_blocks(struct defrag_ctx *c, struct allocation *space);
+void commit_reservation(struct defrag_ctx *c, struct allocation *space);
+void cancel_reservation(struct defrag_ctx *c, struct allocation *space);
 struct allocation *get_blocks(struct defrag_ctx *c, e2_blkcnt_t num_blocks,
-                              ext2_ino_t inode_nr, blk64_t first_logical);
+                              ext2_ino_t inode_nr, blk64_t first_logical,
+                              blk64_t goal);
 struct allocation *get_range_allocation(blk64_t start_block,
                                         e2_blkcnt_t num_blocks,
                                         blk64_t start_logical);
+int build_free_trees(struct defrag_ctx *c, struct free_extent **extents,
+                     size_t count);
+void account_free_extent(struct defrag_ctx *c, const struct free_extent *e,
+                         int delta);
+e2_blkcnt_t group_largest_free(struct defrag_ctx *c, unsigned long group);
+struct free_extent *free_space_at(struct defrag_ctx *c, blk64_t block,
+                                  struct free_extent *unindexed);
 
 /* inode.c */
+int set_inode(struct defrag_ctx *c, ext2_ino_t nr, struct inode *inode);
+int index_live_inodes(struct defrag_ctx *c);
+int build_data_extent_trees(struct defrag_ctx *c, struct data_extent **extents,
+                            size_t count);
+blk64_t inode_goal(struct defrag_ctx *c, ext2_ino_t inode_nr);
 int try_extent_merge(struct defrag_ctx *, struct inode *, struct data_extent *);
 blk64_t get_physical_block(struct inode *inode, blk64_t logical_block,
                            int *extent_nr);
@@ -188,11 +371,41 @@ int defrag_file_interactive(struct defrag_ctx *c);
 
 /* io.c */
 struct defrag_ctx *open_drive(char *filename);
-int read_block(struct defrag_ctx *c, void *buf, blk64_t block);
-int write_block(struct defrag_ctx *c, void *buf, blk64_t block);
+int read_blocks(struct defrag_ctx *c, void *buf, const blk64_t *blocks,
+                int count);
 int set_e2_filesystem_data(struct defrag_ctx *c);
+struct obstack;
+int append_free_run(struct defrag_ctx *c, struct obstack *list,
+                    struct free_extent **last, blk64_t start, blk64_t end);
+int ensure_free_space(struct defrag_ctx *c, e2_blkcnt_t num_blocks);
 void close_drive(struct defrag_ctx *c);
 
+/* plan.c */
+int plan_begin(struct defrag_ctx *c, const char *path);
+int plan_finish(struct defrag_ctx *c);
+void plan_reservation(struct defrag_ctx *c, ext2_ino_t inode_nr,
+                      const struct allocation *target);
+void plan_inode_move(struct defrag_ctx *c, ext2_ino_t inode_nr);
+void plan_cancel(struct defrag_ctx *c, ext2_ino_t inode_nr);
+void plan_extent_move(struct defrag_ctx *c, ext2_ino_t inode_nr,
+                      blk64_t from, e2_blkcnt_t num_blocks, blk64_t to,
+                      int uninit);
+void plan_run_move(struct defrag_ctx *c, ext2_ino_t inode_nr, blk64_t from,
+                   e2_blkcnt_t num_blocks, blk64_t to, int nr_extents,
+                   e2_blkcnt_t copied);
+void plan_metadata_write(struct defrag_ctx *c, ext2_ino_t inode_nr);
+int run_plan(struct defrag_ctx *c, const char *path);
+
+/* statefile.c */
+int load_state(struct defrag_ctx *c, const char *path);
+struct inode *restore_inode(struct defrag_ctx *c, ext2_ino_t inode_nr,
+                            struct ext2_inode *on_disk);
+int restore_group_free_space(struct defrag_ctx *c, int group_nr,
+                             struct obstack *list, struct free_extent **last);
+void drop_state(struct defrag_ctx *c);
+int save_state(struct defrag_ctx *c, const char *path);
+uint64_t block_bitmap_hash(struct defrag_ctx *c, int group_nr);
+
 /* metadata_write.c */
 int write_extent_metadata(struct defrag_ctx *c, struct data_extent *e);
 int move_metadata_extent(struct defrag_ctx *c, struct data_extent *extent,
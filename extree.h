@@ -31,10 +31,19 @@
 #endif
 #endif
 
+static inline void remove_data_extent_by_block(struct defrag_ctx *c,
+                                               struct data_extent *e)
+{
+	rb_erase(&e->block_rb, &c->extents_by_block);
+#ifdef BTREE_INDEX
+	btree_remove(&c->extents_index, e->start_block);
+#endif
+}
+
 static inline void rb_remove_data_extent(struct defrag_ctx *c,
                                          struct data_extent *e)
 {
-	rb_erase(&e->block_rb, &c->extents_by_block);
+	remove_data_extent_by_block(c, e);
 	rb_erase(&e->size_rb, &c->extents_by_size);
 }
 
@@ -47,10 +56,69 @@ static inline void rb_remove_data_alloc(struct defrag_ctx *c,
 }
 
 
+static inline e2_blkcnt_t max_free_size(struct rb_node *n)
+{
+	if (!n)
+		return 0;
+	return rb_entry(n, struct free_extent, block_rb)->max_subtree_size;
+}
+
+static inline void update_max_free_size(struct rb_node *n, void *data)
+{
+	struct free_extent *e = rb_entry(n, struct free_extent, block_rb);
+	e2_blkcnt_t max = e->end_block - e->start_block + 1;
+
+	if (max_free_size(n->rb_left) > max)
+		max = max_free_size(n->rb_left);
+	if (max_free_size(n->rb_right) > max)
+		max = max_free_size(n->rb_right);
+	e->max_subtree_size = max;
+}
+
+static inline int free_size_class(e2_blkcnt_t num_blocks)
+{
+	return 63 - __builtin_clzll(num_blocks);
+}
+
+static inline void size_class_insert(struct defrag_ctx *c,
+                                     struct free_extent *e)
+{
+	int k = free_size_class(e->end_block - e->start_block + 1);
+
+	e->class_prev = NULL;
+	e->class_next = c->size_classes[k];
+	if (e->class_next)
+		e->class_next->class_prev = e;
+	c->size_classes[k] = e;
+	c->size_class_map |= (uint64_t)1 << k;
+}
+
+static inline void size_class_remove(struct defrag_ctx *c,
+                                     struct free_extent *e)
+{
+	int k = free_size_class(e->end_block - e->start_block + 1);
+
+	if (e->class_prev)
+		e->class_prev->class_next = e->class_next;
+	else
+		c->size_classes[k] = e->class_next;
+	if (e->class_next)
+		e->class_next->class_prev = e->class_prev;
+	if (!c->size_classes[k])
+		c->size_class_map &= ~((uint64_t)1 << k);
+}
+
 static inline void rb_remove_free_extent(struct defrag_ctx *c,
                                          struct free_extent *e)
 {
+	size_class_remove(c, e);
+	struct rb_node *deepest = rb_augment_erase_begin(&e->block_rb);
+	account_free_extent(c, e, -1);
 	rb_erase(&e->block_rb, &c->free_tree_by_block);
+	rb_augment_erase_end(deepest, update_max_free_size, NULL);
+#ifdef BTREE_INDEX
+	btree_remove(&c->free_index, e->start_block);
+#endif
 	rb_erase(&e->size_rb, &c->free_tree_by_size);
 }
 
@@ -74,6 +142,9 @@ static inline void insert_data_extent_by_block(struct defrag_ctx *c,
 	}
 	rb_link_node(&e->block_rb, parent, p);
 	rb_insert_color(&e->block_rb, &c->extents_by_block);
+#ifdef BTREE_INDEX
+	btree_insert(&c->extents_index, e->start_block, e);
+#endif
 }
 
 static inline void insert_data_extent(struct defrag_ctx *c,
@@ -120,7 +191,9 @@ static inline void insert_free_extent(struct defrag_ctx *c,
 		extent = rb_entry(parent, struct free_extent, size_rb);
 		blk64_t p_num_blocks = extent->end_block - extent->start_block;
 
-		if (num_blocks < p_num_blocks)
+		if (num_blocks < p_num_blocks
+		    || (num_blocks == p_num_blocks
+		        && e->start_block < extent->start_block))
 			p = &(*p)->rb_left;
 		else
 			p = &(*p)->rb_right;
@@ -144,12 +217,24 @@ static inline void insert_free_extent(struct defrag_ctx *c,
 	}
 	rb_link_node(&e->block_rb, parent, p);
 	rb_insert_color(&e->block_rb, &c->free_tree_by_block);
+	rb_augment_insert(&e->block_rb, update_max_free_size, NULL);
+#ifdef BTREE_INDEX
+	btree_insert(&c->free_index, e->start_block, e);
+#endif
+	size_class_insert(c, e);
+	account_free_extent(c, e, 1);
 }
 
 static inline struct data_extent *containing_data_extent(struct defrag_ctx *c,
                                                          blk64_t block)
 {
 	struct rb_node *ret = c->extents_by_block.rb_node;
+#ifdef BTREE_INDEX
+	if (!c->extents_index.broken) {
+		struct data_extent *e = btree_floor(&c->extents_index, block);
+		return e && block <= e->end_block ? e : NULL;
+	}
+#endif
 	while (ret) {
 		struct data_extent *e;
 		e = rb_entry(ret, struct data_extent, block_rb);
@@ -167,6 +252,12 @@ static inline struct free_extent *containing_free_extent(struct defrag_ctx *c,
                                                          blk64_t block)
 {
 	struct rb_node *ret = c->free_tree_by_block.rb_node;
+#ifdef BTREE_INDEX
+	if (!c->free_index.broken) {
+		struct free_extent *e = btree_floor(&c->free_index, block);
+		return e && block <= e->end_block ? e : NULL;
+	}
+#endif
 	while (ret) {
 		struct free_extent *e;
 		e = rb_entry(ret, struct free_extent, block_rb);
@@ -180,11 +271,38 @@ static inline struct free_extent *containing_free_extent(struct defrag_ctx *c,
 	return NULL;
 }
 
+static inline struct data_extent *data_extent_after(struct defrag_ctx *c,
+                                                    blk64_t block)
+{
+	struct data_extent *ret = NULL;
+	struct rb_node *current = c->extents_by_block.rb_node;
+#ifdef BTREE_INDEX
+	if (!c->extents_index.broken)
+		return btree_ceil(&c->extents_index, block);
+#endif
+	while (current) {
+		struct data_extent *e;
+		e = rb_entry(current, struct data_extent, block_rb);
+		if (block > e->start_block) {
+			current = current->rb_right;
+		} else {
+			if (ret == NULL || ret->start_block > e->start_block)
+				ret = e;
+			current = current->rb_left;
+		}
+	}
+	return ret;
+}
+
 static inline struct free_extent *free_extent_after(struct defrag_ctx *c,
                                                     blk64_t block)
 {
 	struct free_extent *ret = NULL;
 	struct rb_node *current = c->free_tree_by_block.rb_node;
+#ifdef BTREE_INDEX
+	if (!c->free_index.broken)
+		return btree_ceil(&c->free_index, block);
+#endif
 	while (current) {
 		struct free_extent *e;
 		e = rb_entry(current, struct free_extent, block_rb);
@@ -199,4 +317,190 @@ static inline struct free_extent *free_extent_after(struct defrag_ctx *c,
 	return ret;
 }
 
+static inline struct free_extent *first_fit_in_subtree(struct rb_node *n,
+                                                      blk64_t block,
+                                                      e2_blkcnt_t num_blocks)
+{
+	struct free_extent *e, *ret;
+
+	if (max_free_size(n) < num_blocks)
+		return NULL;
+	e = rb_entry(n, struct free_extent, block_rb);
+	if (e->start_block < block)
+		return first_fit_in_subtree(n->rb_right, block, num_blocks);
+	ret = first_fit_in_subtree(n->rb_left, block, num_blocks);
+	if (ret)
+		return ret;
+	if (e->end_block - e->start_block + 1 >= num_blocks)
+		return e;
+	return first_fit_in_subtree(n->rb_right, block, num_blocks);
+}
+
+static inline struct free_extent *last_fit_in_subtree(struct rb_node *n,
+                                                     blk64_t block,
+                                                     e2_blkcnt_t num_blocks)
+{
+	struct free_extent *e, *ret;
+
+	if (max_free_size(n) < num_blocks)
+		return NULL;
+	e = rb_entry(n, struct free_extent, block_rb);
+	if (e->start_block >= block)
+		return last_fit_in_subtree(n->rb_left, block, num_blocks);
+	ret = last_fit_in_subtree(n->rb_right, block, num_blocks);
+	if (ret)
+		return ret;
+	if (e->end_block - e->start_block + 1 >= num_blocks)
+		return e;
+	return last_fit_in_subtree(n->rb_left, block, num_blocks);
+}
+
+/* Returns the last free extent starting before block that is at least
+ * num_blocks blocks long.
+ */
+static inline struct free_extent *free_extent_fit_before(struct defrag_ctx *c,
+                                                        blk64_t block,
+                                                        e2_blkcnt_t num_blocks)
+{
+	return last_fit_in_subtree(c->free_tree_by_block.rb_node, block,
+	                           num_blocks);
+}
+
+/* Size of the biggest extent in the subtree starting at or after lo */
+static inline e2_blkcnt_t max_free_size_from(struct rb_node *n, blk64_t lo)
+{
+	e2_blkcnt_t ret = 0, tmp;
+
+	while (n) {
+		struct free_extent *e = rb_entry(n, struct free_extent,
+		                                 block_rb);
+		if (e->start_block < lo) {
+			n = n->rb_right;
+			continue;
+		}
+		tmp = e->end_block - e->start_block + 1;
+		if (tmp > ret)
+			ret = tmp;
+		if (max_free_size(n->rb_right) > ret)
+			ret = max_free_size(n->rb_right);
+		n = n->rb_left;
+	}
+	return ret;
+}
+
+/* Size of the biggest extent in the subtree starting at or before hi */
+static inline e2_blkcnt_t max_free_size_until(struct rb_node *n, blk64_t hi)
+{
+	e2_blkcnt_t ret = 0, tmp;
+
+	while (n) {
+		struct free_extent *e = rb_entry(n, struct free_extent,
+		                                 block_rb);
+		if (e->start_block > hi) {
+			n = n->rb_left;
+			continue;
+		}
+		tmp = e->end_block - e->start_block + 1;
+		if (tmp > ret)
+			ret = tmp;
+		if (max_free_size(n->rb_left) > ret)
+			ret = max_free_size(n->rb_left);
+		n = n->rb_right;
+	}
+	return ret;
+}
+
+/* Returns the size of the biggest free extent starting between lo and hi,
+ * inclusive, in logarithmic time.
+ */
+static inline e2_blkcnt_t max_free_size_in_range(struct defrag_ctx *c,
+                                                 blk64_t lo, blk64_t hi)
+{
+	struct rb_node *n = c->free_tree_by_block.rb_node;
+	e2_blkcnt_t ret, tmp;
+
+	/* Find the node where the paths to lo and hi split */
+	while (n) {
+		struct free_extent *e = rb_entry(n, struct free_extent,
+		                                 block_rb);
+		if (e->start_block < lo)
+			n = n->rb_right;
+		else if (e->start_block > hi)
+			n = n->rb_left;
+		else
+			break;
+	}
+	if (!n)
+		return 0;
+	ret = rb_entry(n, struct free_extent, block_rb)->end_block
+	      - rb_entry(n, struct free_extent, block_rb)->start_block + 1;
+	tmp = max_free_size_from(n->rb_left, lo);
+	if (tmp > ret)
+		ret = tmp;
+	tmp = max_free_size_until(n->rb_right, hi);
+	if (tmp > ret)
+		ret = tmp;
+	return ret;
+}
+
+/* Returns the first free extent starting at or after block that is at least
+ * num_blocks blocks long. Subtrees without a big enough extent are skipped,
+ * so this takes logarithmic time.
+ */
+static inline struct free_extent *free_extent_fit_after(struct defrag_ctx *c,
+                                                       blk64_t block,
+                                                       e2_blkcnt_t num_blocks)
+{
+	return first_fit_in_subtree(c->free_tree_by_block.rb_node, block,
+	                            num_blocks);
+}
+
+/* Returns a free extent of at least num_blocks blocks: the first one that is
+ * big enough in the size class of num_blocks, or else the first one of the
+ * smallest bigger class. Only the class of num_blocks is searched, the
+ * extents of a bigger class all fit. Returns NULL if none fits.
+ */
+static inline struct free_extent *free_extent_near_fit(struct defrag_ctx *c,
+                                                      e2_blkcnt_t num_blocks)
+{
+	struct free_extent *e;
+	uint64_t bigger;
+	int k;
+
+	if (!num_blocks)
+		num_blocks = 1;
+	k = free_size_class(num_blocks);
+	for (e = c->size_classes[k]; e; e = e->class_next)
+		if (e->end_block - e->start_block + 1 >= num_blocks)
+			return e;
+	if (k == FREE_SIZE_CLASSES - 1)
+		return NULL;
+	bigger = c->size_class_map & (~(uint64_t)0 << (k + 1));
+	if (!bigger)
+		return NULL;
+	return c->size_classes[__builtin_ctzll(bigger)];
+}
+
+/* Returns the smallest free extent of at least num_blocks blocks. Extents of
+ * equal size are ordered by start block, so of those the first one on the
+ * disk is returned.
+ */
+static inline struct free_extent *free_extent_by_size(struct defrag_ctx *c,
+                                                      e2_blkcnt_t num_blocks)
+{
+	struct free_extent *ret = NULL;
+	struct rb_node *current = c->free_tree_by_size.rb_node;
+	while (current) {
+		struct free_extent *e;
+		e = rb_entry(current, struct free_extent, size_rb);
+		if (e->end_block - e->start_block + 1 < num_blocks) {
+			current = current->rb_right;
+		} else {
+			ret = e;
+			current = current->rb_left;
+		}
+	}
+	return ret;
+}
+
 #endif
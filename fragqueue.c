@@ -0,0 +1,204 @@
+/*
+    Copyright 2009 Enno Ruijters
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of version 2 of the GNU General
+    Public License as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Queue of the fragmented inodes, worst first. The queue is a binary max
+ * heap on the fragmentation score, with the heap position of every inode
+ * kept so that its score can be changed when its allocation changes.
+ *
+ * Besides, it lists the inodes whose metadata may have become fragmented
+ * because their allocation changed, so that only those are rewritten.
+ */
+
+#include <stdlib.h>
+#include "e2defrag.h"
+
+/* Position of an inode that is not in the heap, but on the stalled list */
+#define STALLED UINT32_MAX
+
+static void set_entry(struct frag_queue *q, uint32_t i,
+                      const struct frag_queue_entry *e)
+{
+	q->heap[i] = *e;
+	q->pos[e->inode_nr] = i + 1;
+}
+
+static void sift_up(struct frag_queue *q, uint32_t i)
+{
+	struct frag_queue_entry e = q->heap[i];
+
+	while (i > 0 && q->heap[(i - 1) / 2].score < e.score) {
+		set_entry(q, i, &q->heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	set_entry(q, i, &e);
+}
+
+static void sift_down(struct frag_queue *q, uint32_t i)
+{
+	struct frag_queue_entry e = q->heap[i];
+
+	while (2 * i + 1 < q->nr) {
+		uint32_t child = 2 * i + 1;
+		if (child + 1 < q->nr
+		    && q->heap[child + 1].score > q->heap[child].score)
+			child++;
+		if (q->heap[child].score <= e.score)
+			break;
+		set_entry(q, i, &q->heap[child]);
+		i = child;
+	}
+	set_entry(q, i, &e);
+}
+
+static void remove_at(struct frag_queue *q, uint32_t i)
+{
+	q->pos[q->heap[i].inode_nr] = 0;
+	q->nr--;
+	if (i == q->nr)
+		return;
+	set_entry(q, i, &q->heap[q->nr]);
+	sift_down(q, i);
+	sift_up(q, q->pos[q->heap[i].inode_nr] - 1);
+}
+
+/* Builds the queue from all inodes with fragmented data and attaches it to
+ * c, so that changes to the allocations keep it up to date.
+ */
+int frag_queue_init(struct defrag_ctx *c, struct frag_queue *q)
+{
+	ext2_ino_t n;
+	uint32_t i;
+
+	q->pos = calloc(c->sb.s_inodes_count + 1, sizeof(*q->pos));
+	q->heap = malloc((c->nr_live_inodes + 1) * sizeof(*q->heap));
+	q->stalled = malloc((c->nr_live_inodes + 1) * sizeof(*q->stalled));
+	q->changed = malloc((c->nr_live_inodes + 1) * sizeof(*q->changed));
+	q->is_changed = calloc(c->sb.s_inodes_count + 1, 1);
+	if (!q->pos || !q->heap || !q->stalled || !q->changed
+	    || !q->is_changed) {
+		frag_queue_destroy(c, q);
+		return -1;
+	}
+	q->nr = q->nr_stalled = q->nr_changed = 0;
+	for (n = 0; n < c->nr_live_inodes; n++) {
+		ext2_ino_t inode_nr = c->live_inodes[n];
+		struct inode *inode = get_inode(c, inode_nr);
+		uint64_t score = fragmentation_score(c, inode->data);
+		if (inode->metadata) {
+			q->changed[q->nr_changed++] = inode_nr;
+			q->is_changed[inode_nr] = 1;
+		}
+		if (!score)
+			continue;
+		q->heap[q->nr].inode_nr = inode_nr;
+		q->heap[q->nr].score = score;
+		q->pos[inode_nr] = ++q->nr;
+	}
+	for (i = q->nr / 2; i > 0; i--)
+		sift_down(q, i - 1);
+	c->frag_queue = q;
+	return 0;
+}
+
+void frag_queue_destroy(struct defrag_ctx *c, struct frag_queue *q)
+{
+	if (c->frag_queue == q)
+		c->frag_queue = NULL;
+	free(q->pos);
+	free(q->heap);
+	free(q->stalled);
+	free(q->changed);
+	free(q->is_changed);
+}
+
+/* Takes the most fragmented inode out of the queue. Returns 0 if the queue
+ * is empty.
+ */
+ext2_ino_t frag_queue_pop(struct frag_queue *q)
+{
+	ext2_ino_t inode_nr;
+
+	if (!q->nr)
+		return 0;
+	inode_nr = q->heap[0].inode_nr;
+	remove_at(q, 0);
+	return inode_nr;
+}
+
+/* Sets aside an inode that could not be improved. It is not tried again
+ * until frag_queue_retry() is called after the free space has changed.
+ */
+void frag_queue_stall(struct frag_queue *q, ext2_ino_t inode_nr)
+{
+	if (q->pos[inode_nr] == STALLED)
+		return;
+	if (q->pos[inode_nr])
+		remove_at(q, q->pos[inode_nr] - 1);
+	q->pos[inode_nr] = STALLED;
+	q->stalled[q->nr_stalled++] = inode_nr;
+}
+
+static void requeue(struct defrag_ctx *c, struct frag_queue *q,
+                    ext2_ino_t inode_nr)
+{
+	struct inode *inode = get_inode(c, inode_nr);
+	uint64_t score = inode ? fragmentation_score(c, inode->data) : 0;
+	uint32_t i = q->pos[inode_nr];
+
+	if (!i) {
+		if (!score)
+			return;
+		q->heap[q->nr].inode_nr = inode_nr;
+		q->heap[q->nr].score = score;
+		sift_up(q, q->nr++);
+	} else if (!score) {
+		remove_at(q, i - 1);
+	} else {
+		q->heap[i - 1].score = score;
+		sift_up(q, i - 1);
+		sift_down(q, q->pos[inode_nr] - 1);
+	}
+}
+
+/* Puts the stalled inodes back in the queue with fresh scores */
+void frag_queue_retry(struct defrag_ctx *c, struct frag_queue *q)
+{
+	uint32_t i;
+
+	for (i = 0; i < q->nr_stalled; i++) {
+		q->pos[q->stalled[i]] = 0;
+		requeue(c, q, q->stalled[i]);
+	}
+	q->nr_stalled = 0;
+}
+
+/* Must be called when the allocation of an inode has changed */
+void frag_queue_update(struct defrag_ctx *c, ext2_ino_t inode_nr)
+{
+	struct frag_queue *q = c->frag_queue;
+
+	if (!q || !get_inode(c, inode_nr))
+		return;
+	if (!q->is_changed[inode_nr]) {
+		q->is_changed[inode_nr] = 1;
+		q->changed[q->nr_changed++] = inode_nr;
+	}
+	/* Stalled inodes are rescored when they are retried */
+	if (q->pos[inode_nr] == STALLED)
+		return;
+	requeue(c, q, inode_nr);
+}
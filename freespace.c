@@ -15,6 +15,8 @@
     Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#include <stdlib.h>
+#include <string.h>
 #include <malloc.h>
 #include <errno.h>
 #include <obstack.h>
@@ -23,29 +25,64 @@
 #include "e2defrag.h"
 #include "extree.h"
 
-static int allocate_space(struct defrag_ctx *c,
-                          blk64_t start, e2_blkcnt_t numblocks)
+/* Limits for the search for a tighter combination of free extents */
+#define PACK_CANDIDATES 64
+#define PACK_MAX_STEPS 100000
+
+/* Returns the free extent that contains block, or NULL if the block is in
+ * use. Free extents too small for the free space trees are read from the
+ * block bitmaps into *unindexed.
+ */
+struct free_extent *free_space_at(struct defrag_ctx *c, blk64_t block,
+                                  struct free_extent *unindexed)
 {
-	struct free_extent *extent;
-	extent = containing_free_extent(c, start);
+	struct free_extent *extent = containing_free_extent(c, block);
+
+	if (extent || global_settings.min_free_extent <= 1)
+		return extent;
+	if (find_free_run(c, block, &unindexed->start_block,
+	                  &unindexed->end_block) < 0)
+		return NULL;
+	return unindexed;
+}
+
+/* Puts a shrunk or merged free extent back in the indexes, unless it is
+ * now too small to be kept there.
+ */
+static void reinsert_free_extent(struct defrag_ctx *c,
+                                 struct free_extent *extent)
+{
+	if (extent->end_block >= extent->start_block
+	    && free_extent_indexed(extent->end_block - extent->start_block + 1))
+		insert_free_extent(c, extent);
+	else
+		slab_free(&c->free_extent_slab, extent);
+}
+
+/* Removes the given blocks from the free space indexes only */
+static int take_free_space(struct defrag_ctx *c,
+                           blk64_t start, e2_blkcnt_t numblocks)
+{
+	struct free_extent *extent, unindexed;
+	extent = free_space_at(c, start, &unindexed);
 	if (!extent || extent->end_block < start + numblocks - 1) {
 		errno = ENOSPC;
 		return -1;
 	}
+	/* Whatever is left of it is too small to index as well */
+	if (extent == &unindexed)
+		return 0;
 	if (start == extent->start_block) {
 		rb_remove_free_extent(c, extent);
 		extent->start_block += numblocks;
-		if (extent->end_block < extent->start_block)
-			free(extent);
-		else
-			insert_free_extent(c, extent);
+		reinsert_free_extent(c, extent);
 	} else if (extent->end_block == start + numblocks - 1) {
 		rb_remove_free_extent(c, extent);
 		extent->end_block = start - 1;
-		insert_free_extent(c, extent);
+		reinsert_free_extent(c, extent);
 	} else {
 		struct free_extent *new_extent;
-		new_extent = malloc(sizeof *new_extent);
+		new_extent = slab_alloc(&c->free_extent_slab);
 		if (new_extent == NULL)
 			return -1;
 		new_extent->start_block = extent->start_block;
@@ -53,10 +90,9 @@ static int allocate_space(struct defrag_ctx *c,
 		rb_remove_free_extent(c, extent);
 		extent->start_block = start + numblocks;
 		/* end_block unchanged */
-		insert_free_extent(c, extent);
-		insert_free_extent(c, new_extent);
+		reinsert_free_extent(c, extent);
+		reinsert_free_extent(c, new_extent);
 	}
-	mark_blocks_used(c, start, numblocks);
 	return 0;
 }
 
@@ -73,23 +109,67 @@ static struct free_extent *try_merge(struct defrag_ctx *c,
 	if (other_extent) {
 		rb_remove_free_extent(c, other_extent);
 		other_extent->end_block = extent->end_block;
-		free(extent);
+		slab_free(&c->free_extent_slab, extent);
 		extent = other_extent;
 	}
 	other_extent = containing_free_extent(c, extent->end_block + 1);
 	if (other_extent) {
 		rb_remove_free_extent(c, other_extent);
 		other_extent->start_block = extent->start_block;
-		free(extent);
+		slab_free(&c->free_extent_slab, extent);
 		extent = other_extent;
 	}
 	return extent;
 }
 
-int deallocate_space(struct defrag_ctx *c, blk64_t start, e2_blkcnt_t numblocks)
+/* With unindexed small free extents, the freed blocks may join free blocks
+ * that only the bitmaps know about, so the merged extent is read from the
+ * bitmaps. The blocks must already be marked unused.
+ */
+static int return_bitmap_free_space(struct defrag_ctx *c, blk64_t start,
+                                    e2_blkcnt_t numblocks)
+{
+	struct free_extent *extent, *other_extent;
+	blk64_t run_start, run_end;
+
+	if (find_free_run(c, start, &run_start, &run_end) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	extent = containing_free_extent(c, start - 1);
+	if (extent)
+		rb_remove_free_extent(c, extent);
+	other_extent = containing_free_extent(c, start + numblocks);
+	if (other_extent) {
+		rb_remove_free_extent(c, other_extent);
+		if (extent)
+			slab_free(&c->free_extent_slab, other_extent);
+		else
+			extent = other_extent;
+	}
+	if (!free_extent_indexed(run_end - run_start + 1)) {
+		if (extent)
+			slab_free(&c->free_extent_slab, extent);
+		return 0;
+	}
+	if (!extent)
+		extent = slab_alloc(&c->free_extent_slab);
+	if (extent == NULL)
+		return -1;
+	extent->start_block = run_start;
+	extent->end_block = run_end;
+	insert_free_extent(c, extent);
+	return 0;
+}
+
+/* Adds the given blocks to the free space indexes only */
+static int return_free_space(struct defrag_ctx *c,
+                             blk64_t start, e2_blkcnt_t numblocks)
 {
 	struct free_extent *extent;
 
+	if (global_settings.min_free_extent > 1)
+		return return_bitmap_free_space(c, start, numblocks);
 	if ((extent = containing_free_extent(c, start - 1)) != NULL) {
 		rb_remove_free_extent(c, extent);
 		extent->end_block = start + numblocks - 1;
@@ -103,17 +183,23 @@ int deallocate_space(struct defrag_ctx *c, blk64_t start, e2_blkcnt_t numblocks)
 		if (extent == NULL)
 			return -1;
 	} else {
-		extent = malloc(sizeof *extent);
+		extent = slab_alloc(&c->free_extent_slab);
 		if (extent == NULL)
 			return -1;
 		extent->start_block = start;
 		extent->end_block = start + numblocks - 1;
 	}
 	insert_free_extent(c, extent);
-	mark_blocks_unused(c, start, numblocks);
 	return 0;
 }
 
+int deallocate_space(struct defrag_ctx *c, blk64_t start, e2_blkcnt_t numblocks)
+{
+	/* The bitmaps first, return_free_space may need them up to date */
+	mark_blocks_unused(c, start, numblocks);
+	return return_free_space(c, start, numblocks);
+}
+
 /* Note: also frees the allocation, even on errors */
 int deallocate_blocks(struct defrag_ctx *c, struct allocation *space)
 {
@@ -214,7 +300,14 @@ static struct rb_node **simple_allocator(struct defrag_ctx *c,
 	return ret;
 }
 
-int allocate(struct defrag_ctx *c, struct allocation *space)
+/* Takes the space out of the free space indexes, so that no other
+ * allocation gets it, without marking it used on disk yet. A reservation is
+ * either made permanent by commit_reservation() or undone by
+ * cancel_reservation().
+ * Small free extents are only known to the bitmaps if min_free_extent is
+ * set, so then the blocks are marked used right away.
+ */
+int reserve_blocks(struct defrag_ctx *c, struct allocation *space)
 {
 	int i;
 	struct data_extent *extent;
@@ -223,9 +316,11 @@ int allocate(struct defrag_ctx *c, struct allocation *space)
 		int tmp;
 		extent = &space->extents[i];
 		num_blocks = extent->end_block - extent->start_block + 1;
-		tmp = allocate_space(c, extent->start_block, num_blocks);
+		tmp = take_free_space(c, extent->start_block, num_blocks);
 		if (tmp < 0)
 			goto out_dealloc;
+		if (global_settings.min_free_extent > 1)
+			mark_blocks_used(c, extent->start_block, num_blocks);
 	}
 	return 0;
 
@@ -234,24 +329,192 @@ out_dealloc:
 		e2_blkcnt_t num_blocks;
 		extent = &space->extents[i];
 		num_blocks = extent->end_block - extent->start_block + 1;
-		deallocate_space(c, extent->start_block, num_blocks);
+		if (global_settings.min_free_extent > 1)
+			mark_blocks_unused(c, extent->start_block, num_blocks);
+		return_free_space(c, extent->start_block, num_blocks);
 	}
 	return -1;
 }
 
+void commit_reservation(struct defrag_ctx *c, struct allocation *space)
+{
+	int i;
+	if (global_settings.min_free_extent > 1)
+		return;
+	for (i = 0; i < space->extent_count; i++) {
+		struct data_extent *extent = &space->extents[i];
+		mark_blocks_used(c, extent->start_block,
+		                 extent->end_block - extent->start_block + 1);
+	}
+}
+
+void cancel_reservation(struct defrag_ctx *c, struct allocation *space)
+{
+	int i;
+	for (i = 0; i < space->extent_count; i++) {
+		struct data_extent *extent = &space->extents[i];
+		e2_blkcnt_t num_blocks;
+		num_blocks = extent->end_block - extent->start_block + 1;
+		if (global_settings.min_free_extent > 1)
+			mark_blocks_unused(c, extent->start_block, num_blocks);
+		return_free_space(c, extent->start_block, num_blocks);
+	}
+}
+
+int allocate(struct defrag_ctx *c, struct allocation *space)
+{
+	if (reserve_blocks(c, space) < 0)
+		return -1;
+	commit_reservation(c, space);
+	return 0;
+}
+
+struct pack_search {
+	e2_blkcnt_t target;
+	int num_extents;
+	int nr_candidates;
+	e2_blkcnt_t *sizes; /* descending */
+	e2_blkcnt_t *prefix; /* prefix[i] is the sum of the first i sizes */
+	int *chosen, *best;
+	e2_blkcnt_t best_sum;
+	long steps;
+};
+
+/* Branch and bound over the candidates: picks num_extents of them with the
+ * smallest total size that still holds target blocks.
+ */
+static void pack_search(struct pack_search *s, int start, int depth,
+                        e2_blkcnt_t sum)
+{
+	int left = s->num_extents - depth;
+	int i;
+
+	if (!left) {
+		if (sum >= s->target && sum < s->best_sum) {
+			s->best_sum = sum;
+			memcpy(s->best, s->chosen, depth * sizeof(*s->best));
+		}
+		return;
+	}
+	for (i = start; i + left <= s->nr_candidates; i++) {
+		if (s->best_sum == s->target || ++s->steps > PACK_MAX_STEPS)
+			return;
+		/* The biggest remaining sizes are not enough anymore */
+		if (sum + s->prefix[i + left] - s->prefix[i] < s->target)
+			return;
+		if (sum + s->sizes[i] >= s->best_sum)
+			continue;
+		s->chosen[depth] = i;
+		pack_search(s, i + 1, depth + 1, sum + s->sizes[i]);
+	}
+}
+
+/* Tries to replace the chosen free extents by an equally long combination
+ * of free extents that wastes less of them, leaving the biggest free
+ * extents intact for later. Only the largest free extents are considered.
+ */
+static void pack_allocation(struct defrag_ctx *c, struct rb_node **nodes,
+                            e2_blkcnt_t *num_allocated,
+                            e2_blkcnt_t num_blocks, int num_extents)
+{
+	struct rb_node *candidates[PACK_CANDIDATES], *n;
+	e2_blkcnt_t sizes[PACK_CANDIDATES], prefix[PACK_CANDIDATES + 1];
+	int chosen[PACK_CANDIDATES], best[PACK_CANDIDATES];
+	struct pack_search s;
+	int i;
+
+	if (*num_allocated == num_blocks || num_extents > PACK_CANDIDATES)
+		return;
+	prefix[0] = 0;
+	n = rb_last(&c->free_tree_by_size);
+	for (i = 0; i < PACK_CANDIDATES && n; i++, n = rb_prev(n)) {
+		struct free_extent *e;
+		e = rb_entry(n, struct free_extent, size_rb);
+		candidates[i] = n;
+		sizes[i] = e->end_block - e->start_block + 1;
+		prefix[i + 1] = prefix[i] + sizes[i];
+	}
+	s.target = num_blocks;
+	s.num_extents = num_extents;
+	s.nr_candidates = i;
+	s.sizes = sizes;
+	s.prefix = prefix;
+	s.chosen = chosen;
+	s.best = best;
+	s.best_sum = *num_allocated;
+	s.steps = 0;
+	pack_search(&s, 0, 0, 0);
+	if (s.best_sum == *num_allocated)
+		return;
+	for (i = 0; i < num_extents; i++)
+		nodes[i] = candidates[best[i]];
+	*num_allocated = s.best_sum;
+}
+
+/* Returns the free extent of at least num_blocks blocks that starts closest
+ * to goal. An extent that keeps the blocks in the flex group of goal is
+ * preferred over a closer one that does not.
+ */
+static struct free_extent *closest_fit(struct defrag_ctx *c,
+                                       e2_blkcnt_t num_blocks, blk64_t goal)
+{
+	e2_blkcnt_t flex_bg_size = flex_bg_blocks(c);
+	blk64_t first = c->sb.s_first_data_block;
+	struct free_extent *after, *before;
+	int after_near, before_near;
+
+	after = free_extent_fit_after(c, goal, num_blocks);
+	before = free_extent_fit_before(c, goal, num_blocks);
+	if (!after || !before)
+		return after ? after : before;
+	after_near = (after->start_block + num_blocks - 1 - first)
+	             / flex_bg_size == (goal - first) / flex_bg_size;
+	before_near = (before->start_block - first) / flex_bg_size
+	              == (goal - first) / flex_bg_size;
+	if (after_near != before_near)
+		return after_near ? after : before;
+	if (after->start_block - goal <= goal - before->start_block)
+		return after;
+	return before;
+}
+
+/* Finds space for num_blocks blocks. If they fit in one free extent, the one
+ * closest to goal is used, or the best fitting one if goal is 0. Otherwise
+ * the biggest free extents are combined.
+ */
 struct allocation *get_blocks(struct defrag_ctx *c, e2_blkcnt_t num_blocks,
-                              ext2_ino_t inode_nr, blk64_t first_logical)
+                              ext2_ino_t inode_nr, blk64_t first_logical,
+                              blk64_t goal)
 {
 	struct allocation *ret;
+	struct free_extent *fit;
 	struct rb_node **nodes;
 	e2_blkcnt_t num_allocated;
 	int num_extents, i;
 
-	nodes = simple_allocator(c, num_blocks, &num_allocated, &num_extents);
-	if (nodes == NULL)
+	if (ensure_free_space(c, num_blocks) < 0)
 		return NULL;
-
-	optimize_allocation(nodes, &num_allocated, num_blocks, num_extents);
+	if (goal) {
+		fit = closest_fit(c, num_blocks, goal);
+	} else {
+		fit = free_extent_near_fit(c, num_blocks);
+	}
+	if (fit) {
+		nodes = malloc(sizeof(*nodes));
+		if (nodes == NULL)
+			return NULL;
+		nodes[0] = &fit->size_rb;
+		num_extents = 1;
+	} else {
+		nodes = simple_allocator(c, num_blocks, &num_allocated,
+		                         &num_extents);
+		if (nodes == NULL)
+			return NULL;
+		optimize_allocation(nodes, &num_allocated, num_blocks,
+		                    num_extents);
+		pack_allocation(c, nodes, &num_allocated, num_blocks,
+		                num_extents);
+	}
 	ret = malloc(sizeof(struct allocation)
 	             + num_extents * sizeof(struct data_extent));
 	if (!ret) {
@@ -299,3 +562,106 @@ struct allocation *get_range_allocation(blk64_t start_block,
 	ret->extents[0].start_logical = start_logical;
 	return ret;
 }
+
+static int compare_free_size(const void *a, const void *b)
+{
+	const struct free_extent *x = *(struct free_extent * const *)a;
+	const struct free_extent *y = *(struct free_extent * const *)b;
+	e2_blkcnt_t x_size = x->end_block - x->start_block;
+	e2_blkcnt_t y_size = y->end_block - y->start_block;
+
+	if (x_size != y_size)
+		return x_size < y_size ? -1 : 1;
+	if (x->start_block != y->start_block)
+		return x->start_block < y->start_block ? -1 : 1;
+	return 0;
+}
+
+/* Fills the empty free space indexes with the given extents, which must be
+ * sorted by block. The trees are built in one go instead of rebalancing on
+ * every insert. The extents array is reordered.
+ */
+int build_free_trees(struct defrag_ctx *c, struct free_extent **extents,
+                     size_t count)
+{
+	struct rb_node **nodes;
+	size_t i;
+
+	nodes = malloc((count ? count : 1) * sizeof(*nodes));
+	if (!nodes)
+		return -1;
+	for (i = 0; i < count; i++) {
+		nodes[i] = &extents[i]->block_rb;
+		size_class_insert(c, extents[i]);
+		account_free_extent(c, extents[i], 1);
+#ifdef BTREE_INDEX
+		btree_insert(&c->free_index, extents[i]->start_block,
+		             extents[i]);
+#endif
+	}
+	rb_build_sorted(&c->free_tree_by_block, nodes, count,
+	                update_max_free_size, NULL);
+	qsort(extents, count, sizeof(*extents), compare_free_size);
+	for (i = 0; i < count; i++)
+		nodes[i] = &extents[i]->size_rb;
+	rb_build_sorted(&c->free_tree_by_size, nodes, count, NULL, NULL);
+	free(nodes);
+	return 0;
+}
+
+/* Updates the group summaries for a free extent that is added to (delta 1)
+ * or removed from (delta -1) the free space indexes.
+ */
+void account_free_extent(struct defrag_ctx *c, const struct free_extent *e,
+                         int delta)
+{
+	blk64_t first = c->sb.s_first_data_block;
+	blk64_t per_group = c->sb.s_blocks_per_group;
+	e2_blkcnt_t size = e->end_block - e->start_block + 1;
+	blk64_t group, last_group;
+
+	last_group = (e->end_block - first) / per_group;
+	group = (e->start_block - first) / per_group;
+	c->group_free[group].nr_extents += delta;
+	for (; group <= last_group; group++) {
+		struct group_free_summary *s = &c->group_free[group];
+		blk64_t start = group * per_group + first;
+		blk64_t end = start + per_group - 1;
+
+		if (start < e->start_block)
+			start = e->start_block;
+		if (end > e->end_block)
+			end = e->end_block;
+		if (delta > 0) {
+			s->free_blocks += end - start + 1;
+			if (size > s->largest)
+				s->largest = size;
+		} else {
+			s->free_blocks -= end - start + 1;
+			if (size == s->largest)
+				s->largest_stale = 1;
+		}
+	}
+}
+
+/* Returns the size of the biggest indexed free extent overlapping the
+ * group. Free extents smaller than min_free_extent are not seen.
+ */
+e2_blkcnt_t group_largest_free(struct defrag_ctx *c, unsigned long group)
+{
+	struct group_free_summary *s = &c->group_free[group];
+	blk64_t start, end;
+	struct free_extent *before;
+
+	if (!s->largest_stale)
+		return s->largest;
+	start = group * c->sb.s_blocks_per_group + c->sb.s_first_data_block;
+	end = start + c->sb.s_blocks_per_group - 1;
+	s->largest = max_free_size_in_range(c, start, end);
+	before = containing_free_extent(c, start - 1);
+	if (before && before->end_block >= start
+	    && before->end_block - before->start_block + 1 > s->largest)
+		s->largest = before->end_block - before->start_block + 1;
+	s->largest_stale = 0;
+	return s->largest;
+}
@@ -17,6 +17,7 @@
 
 #define _LARGEFILE64_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
@@ -26,6 +27,127 @@
 
 #define EXT2_SECTORS_PER_BLOCK(sb) (EXT2_BLOCK_SIZE(sb) / 512)
 
+/* Stores inode as inode number nr. The table for the inode's group is
+ * allocated on first use; only the parser thread of that group touches it,
+ * so no locking is needed.
+ */
+int set_inode(struct defrag_ctx *c, ext2_ino_t nr, struct inode *inode)
+{
+	struct inode ***table;
+	if (nr == 0 || nr > c->sb.s_inodes_count) {
+		errno = EINVAL;
+		return -1;
+	}
+	nr--;
+	table = &c->inode_tables[nr / EXT2_INODES_PER_GROUP(&c->sb)];
+	if (!*table) {
+		if (!inode)
+			return 0;
+		*table = calloc(EXT2_INODES_PER_GROUP(&c->sb),
+		                sizeof(struct inode *));
+		if (!*table)
+			return -1;
+	}
+	(*table)[nr % EXT2_INODES_PER_GROUP(&c->sb)] = inode;
+	return 0;
+}
+
+/* Builds the sorted list of inode numbers that have an inode, so that
+ * iterating over all inodes does not have to visit the empty slots.
+ */
+int index_live_inodes(struct defrag_ctx *c)
+{
+	const ext2_ino_t per_group = EXT2_INODES_PER_GROUP(&c->sb);
+	ext2_ino_t count = 0, i, group;
+
+	for (group = 0; group < ext2_groups_on_disk(&c->sb); group++) {
+		if (!c->inode_tables[group])
+			continue;
+		for (i = 0; i < per_group; i++)
+			count += c->inode_tables[group][i] != NULL;
+	}
+	free(c->live_inodes);
+	c->live_inodes = malloc((count + 1) * sizeof(ext2_ino_t));
+	if (!c->live_inodes)
+		return -1;
+	c->nr_live_inodes = 0;
+	for (group = 0; group < ext2_groups_on_disk(&c->sb); group++) {
+		if (!c->inode_tables[group])
+			continue;
+		for (i = 0; i < per_group; i++) {
+			if (c->inode_tables[group][i])
+				c->live_inodes[c->nr_live_inodes++] =
+				                         group * per_group + i + 1;
+		}
+	}
+	return 0;
+}
+
+static int compare_extent_block(const void *a, const void *b)
+{
+	const struct data_extent *x = *(struct data_extent * const *)a;
+	const struct data_extent *y = *(struct data_extent * const *)b;
+
+	if (x->start_block != y->start_block)
+		return x->start_block < y->start_block ? -1 : 1;
+	return 0;
+}
+
+static int compare_extent_size(const void *a, const void *b)
+{
+	const struct data_extent *x = *(struct data_extent * const *)a;
+	const struct data_extent *y = *(struct data_extent * const *)b;
+	e2_blkcnt_t x_size = x->end_block - x->start_block;
+	e2_blkcnt_t y_size = y->end_block - y->start_block;
+
+	if (x_size != y_size)
+		return x_size < y_size ? -1 : 1;
+	return compare_extent_block(a, b);
+}
+
+/* Fills the empty data extent trees with the given extents, sorting them
+ * once and building the trees in linear time. The extents array is
+ * reordered.
+ */
+int build_data_extent_trees(struct defrag_ctx *c, struct data_extent **extents,
+                            size_t count)
+{
+	struct rb_node **nodes;
+	size_t i;
+
+	nodes = malloc((count ? count : 1) * sizeof(*nodes));
+	if (!nodes)
+		return -1;
+	qsort(extents, count, sizeof(*extents), compare_extent_block);
+	for (i = 0; i < count; i++) {
+		nodes[i] = &extents[i]->block_rb;
+#ifdef BTREE_INDEX
+		btree_insert(&c->extents_index, extents[i]->start_block,
+		             extents[i]);
+#endif
+	}
+	rb_build_sorted(&c->extents_by_block, nodes, count, NULL, NULL);
+	qsort(extents, count, sizeof(*extents), compare_extent_size);
+	for (i = 0; i < count; i++)
+		nodes[i] = &extents[i]->size_rb;
+	rb_build_sorted(&c->extents_by_size, nodes, count, NULL, NULL);
+	free(nodes);
+	return 0;
+}
+
+/* Returns the block new blocks of an inode should be close to: the start of
+ * its data, or the start of its group if it has none.
+ */
+blk64_t inode_goal(struct defrag_ctx *c, ext2_ino_t inode_nr)
+{
+	struct inode *inode = get_inode(c, inode_nr);
+	blk64_t group = (inode_nr - 1) / EXT2_INODES_PER_GROUP(&c->sb);
+
+	if (inode && inode->data->extent_count)
+		return inode->data->extents[0].start_block;
+	return group * c->sb.s_blocks_per_group + c->sb.s_first_data_block;
+}
+
 static void inode_remove_from_trees(struct defrag_ctx *c, struct inode *inode)
 {
 	int i;
@@ -37,7 +159,7 @@ int is_metadata(struct defrag_ctx *c, struct data_extent *extent)
 {
 	struct inode *inode;
 	int i;
-	inode = c->inodes[extent->inode_nr];
+	inode = get_inode(c, extent->inode_nr);
 
 	if (inode->metadata == NULL)
 		return 0;
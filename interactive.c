@@ -54,27 +54,27 @@ static int getnumber(long *ret, long min, long max)
 
 static void print_fragged_inodes(const struct defrag_ctx *c)
 {
-	ext2_ino_t i;
-	ext2_ino_t nr_inodes = ext2_inodes_on_disk(&c->sb);
+	ext2_ino_t k;
 	e2_blkcnt_t free_blocks = 0;
-	long free_extents = 0;
-	struct rb_node *n;
+	long free_extents = 0, i;
 
-	n = rb_first(&c->free_tree_by_block);
-	while (n) {
-		struct free_extent *extent;
-		extent = rb_entry(n, struct free_extent, block_rb);
-		free_extents++;
-		free_blocks += extent->end_block - extent->start_block + 1;
-		n = rb_next(n);
+	for (i = 0; i < ext2_groups_on_disk(&c->sb); i++) {
+		free_blocks += c->group_free[i].free_blocks;
+		free_extents += c->group_free[i].nr_extents;
 	}
-	printf("Free space: %ld fragments (%llu blocks)\n",
-	       free_extents, free_blocks);
+	/* The summaries leave out the free extents that are not indexed */
+	if (global_settings.min_free_extent > 1)
+		printf("Free space in fragments of at least %llu blocks: "
+		       "%ld fragments (%llu blocks)\n",
+		       global_settings.min_free_extent, free_extents,
+		       free_blocks);
+	else
+		printf("Free space: %ld fragments (%llu blocks)\n",
+		       free_extents, free_blocks);
 
-	for (i = 0; i < nr_inodes; i++) {
-		const struct inode *inode = c->inodes[i];
-		if (!inode)
-			continue;
+	for (k = 0; k < c->nr_live_inodes; k++) {
+		ext2_ino_t i = c->live_inodes[k];
+		const struct inode *inode = get_inode(c, i);
 		if (inode->data->extent_count > 1) {
 			printf("Inode %u%s: %llu fragments (%llu blocks)\n",
 			       i, inode->metadata ? "" : "*",
@@ -163,7 +163,7 @@ int defrag_file_interactive(struct defrag_ctx *c)
 			inode_nr = number;
 		}
 	} while (inode_nr < EXT2_FIRST_INO(&c->sb));
-	inode = c->inodes[inode_nr];
+	inode = get_inode(c, inode_nr);
 	if (inode == NULL || inode->data->extent_count == 0) {
 		printf("Inode has no data associated\n");
 		return 0;
@@ -175,7 +175,7 @@ int defrag_file_interactive(struct defrag_ctx *c)
 	if (ret < 0)
 		printf("Error: %s\n", strerror(errno));
 	printf("Inode now has %llu fragments\n",
-	       c->inodes[inode_nr]->data->extent_count);
+	       inode->data->extent_count);
 	if (ret && errno != ENOSPC)
 		return ret;
 	else
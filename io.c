@@ -23,40 +23,60 @@
 #include <errno.h>
 #include <limits.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <obstack.h>
+#define obstack_chunk_alloc malloc
+#define obstack_chunk_free free
 #include "e2defrag.h"
 #include "extree.h"
 #include "crc16.h"
 
-int read_block(struct defrag_ctx *c, void *buf, blk64_t block)
-{
-	long long ret;
-	ret = lseek64(c->fd, block * EXT2_BLOCK_SIZE(&c->sb), SEEK_SET);
-	if (ret < 0) {
-		printf("Cannot seek to block %llu (block_size %d)\n", block,
-		       EXT2_BLOCK_SIZE(&c->sb));
-		return -1;
-	}
-	ret = read(c->fd, buf, EXT2_BLOCK_SIZE(&c->sb));
-	if (ret < EXT2_BLOCK_SIZE(&c->sb))
-		return -1;
-	return 0;
-}
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
-int write_block(struct defrag_ctx *c, void *buf, blk64_t block)
+/* Reads count blocks into consecutive block-sized slots of buf. A block
+ * number of 0 stands for a sparse block and yields a zeroed slot. All
+ * blocks are first handed to the kernel as one readahead batch, after which
+ * runs of consecutive blocks are read with a single preadv each.
+ */
+int read_blocks(struct defrag_ctx *c, void *buf, const blk64_t *blocks,
+                int count)
 {
-	long long ret;
-	if (global_settings.simulate)
-		return 0;
-	ret = lseek64(c->fd, block * EXT2_BLOCK_SIZE(&c->sb), SEEK_SET);
-	if (ret < 0) {
-		printf("Cannot seek to block %llu (block_size %d)\n", block,
-		       EXT2_BLOCK_SIZE(&c->sb));
-		return -1;
+	const int block_size = EXT2_BLOCK_SIZE(&c->sb);
+	struct iovec iov[IOV_MAX];
+	int i, n;
+
+	for (i = 0; i < count; i++) {
+		if (blocks[i])
+			posix_fadvise(c->fd, blocks[i] * block_size, block_size,
+			              POSIX_FADV_WILLNEED);
 	}
-	ret = write(c->fd, buf, EXT2_BLOCK_SIZE(&c->sb));
-	if (ret < EXT2_BLOCK_SIZE(&c->sb))
-		return -1;
+	for (i = 0; i < count; i += n) {
+		long long ret;
+		if (!blocks[i]) {
+			memset((char *)buf + i * block_size, 0, block_size);
+			n = 1;
+			continue;
+		}
+		n = 0;
+		do {
+			iov[n].iov_base = (char *)buf + (i + n) * block_size;
+			iov[n].iov_len = block_size;
+			n++;
+		} while (i + n < count && n < IOV_MAX
+		         && blocks[i + n] == blocks[i] + n);
+		ret = preadv64(c->fd, iov, n, blocks[i] * block_size);
+		if (ret < (long long)n * block_size) {
+			if (ret < 0)
+				printf("Cannot read block %llu (block_size %d)\n",
+				       blocks[i], block_size);
+			return -1;
+		}
+	}
+	cache_overlay_blocks(c, buf, blocks, count);
 	return 0;
 }
 
@@ -111,8 +131,7 @@ struct defrag_ctx *open_drive(char *filename)
 	if (tmp < SUPERBLOCK_SIZE)
 		goto error_open;
 
-	ret = calloc(sizeof(struct defrag_ctx)
-	             + sizeof(struct inode *) * sb.s_inodes_count, 1);
+	ret = calloc(sizeof(struct defrag_ctx), 1);
 	if (!ret)
 		goto error_open;
 	nr_block_groups = sb.s_blocks_count / sb.s_blocks_per_group;
@@ -121,17 +140,44 @@ struct defrag_ctx *open_drive(char *filename)
 	ret->bg_maps = malloc(nr_block_groups * sizeof(*ret->bg_maps));
 	if (!ret->bg_maps)
 		goto error_alloc;
+	ret->inode_tables = calloc(nr_block_groups, sizeof(struct inode **));
+	if (!ret->inode_tables)
+		goto error_alloc_maps;
+	ret->group_free = calloc(nr_block_groups, sizeof(*ret->group_free));
+	if (!ret->group_free)
+		goto error_alloc_tables;
 	ret->fd = fd;
 	ret->sb = sb;
 	ret->extents_by_block = RB_ROOT;
 	ret->extents_by_size = RB_ROOT;
 	ret->free_tree_by_size = RB_ROOT;
 	ret->free_tree_by_block = RB_ROOT;
+	slab_init(&ret->free_extent_slab, sizeof(struct free_extent));
+	slab_init(&ret->inode_slab, sizeof(struct inode));
+#ifdef BTREE_INDEX
+	btree_init(&ret->extents_index);
+	btree_init(&ret->free_index);
+#endif
+	tmp = cache_init(ret, BLOCK_CACHE_SIZE);
+	if (tmp)
+		goto error_slabs;
 	tmp = map_gds(ret);
 	if (tmp)
-		goto error_alloc_maps;
+		goto error_cache;
 	return ret;
 
+error_cache:
+	cache_destroy(ret);
+error_slabs:
+#ifdef BTREE_INDEX
+	btree_destroy(&ret->extents_index);
+	btree_destroy(&ret->free_index);
+#endif
+	slab_destroy(&ret->inode_slab);
+	slab_destroy(&ret->free_extent_slab);
+	free(ret->group_free);
+error_alloc_tables:
+	free(ret->inode_tables);
 error_alloc_maps:
 	free(ret->bg_maps);
 error_alloc:
@@ -142,6 +188,34 @@ error_out:
 	return NULL;
 }
 
+/* Maps the inode table of a group and returns a pointer to its first inode */
+static unsigned char *map_inode_table(struct defrag_ctx *c, blk64_t table_start,
+                                      int group_nr)
+{
+	unsigned char *inode_table;
+	off_t table_start_offset, table_delta_offset;
+	size_t table_length;
+	int flags;
+
+	table_start_offset = table_start * EXT2_BLOCK_SIZE(&c->sb);
+	table_delta_offset = table_start_offset % getpagesize();
+	table_length = c->sb.s_inodes_per_group * EXT2_INODE_SIZE(&c->sb);
+	if (table_delta_offset) {
+		table_start_offset -= table_delta_offset;
+		table_length += table_delta_offset;
+	}
+	if (table_length % getpagesize())
+		table_length += getpagesize() - (table_length % getpagesize());
+	flags = global_settings.simulate ? MAP_PRIVATE : MAP_SHARED;
+	inode_table = mmap(NULL, table_length, PROT_READ | PROT_WRITE, flags,
+	                   c->fd, table_start_offset);
+	if (inode_table == MAP_FAILED)
+		return NULL;
+	c->bg_maps[group_nr].map_start = inode_table;
+	c->bg_maps[group_nr].inode_map_length = table_length;
+	return inode_table + table_delta_offset;
+}
+
 long parse_inode_table(struct defrag_ctx *c, blk64_t bitmap_block,
                        blk64_t table_start, int group_nr)
 {
@@ -149,11 +223,11 @@ long parse_inode_table(struct defrag_ctx *c, blk64_t bitmap_block,
 	off_t bitmap_start_offset, bitmap_delta_offset;
 	size_t bitmap_length;
 	unsigned char *inode_table;
-	off_t table_start_offset, table_delta_offset;
-	size_t table_length;
 	long count = 0;
 	const ext2_ino_t first_inode = group_nr * c->sb.s_inodes_per_group;
-	int i, ret;
+	const unsigned long nr_inodes = c->sb.s_inodes_per_group;
+	unsigned long i;
+	int ret;
 
 	bitmap_start_offset = bitmap_block * EXT2_BLOCK_SIZE(&c->sb);
 	bitmap_delta_offset = bitmap_start_offset % getpagesize();
@@ -167,55 +241,36 @@ long parse_inode_table(struct defrag_ctx *c, blk64_t bitmap_block,
 		bitmap_length -= (bitmap_length % getpagesize());
 	}
 
-	bitmap = mmap(NULL, bitmap_length, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	/* The bitmap is only read, so there is no need for a private copy */
+	bitmap = mmap(NULL, bitmap_length, PROT_READ, MAP_SHARED,
 	              c->fd, bitmap_start_offset);
 	if (bitmap == MAP_FAILED)
 		return -1;
 	bitmap = bitmap + bitmap_delta_offset;
 
-	table_start_offset = table_start * EXT2_BLOCK_SIZE(&c->sb);
-	table_delta_offset = table_start_offset % getpagesize();
-	table_length = c->sb.s_inodes_per_group * EXT2_INODE_SIZE(&c->sb);
-	if (table_delta_offset) {
-		table_start_offset -= table_delta_offset;
-		table_length += table_delta_offset;
-	}
-	if (table_length % getpagesize())
-		table_length += getpagesize() - (table_length % getpagesize());
-	i = global_settings.simulate ? MAP_PRIVATE : MAP_SHARED;
-	inode_table = mmap(NULL, table_length, PROT_READ | PROT_WRITE, i, c->fd,
-	                   table_start_offset);
-	if (inode_table == MAP_FAILED) {
+	inode_table = map_inode_table(c, table_start, group_nr);
+	if (!inode_table) {
 		munmap(bitmap - bitmap_delta_offset, bitmap_length);
 		return -1;
 	}
-	c->bg_maps[group_nr].map_start = inode_table;
-	c->bg_maps[group_nr].inode_map_length = table_length;
-	inode_table += table_delta_offset;
 
-	for (i = 0; i < c->sb.s_inodes_per_group; i++) {
-		if (bitmap[i / CHAR_BIT] == 0) {
-			i += CHAR_BIT - (i % CHAR_BIT);
-			continue;
-		}
-		if (bitmap[i / CHAR_BIT] & 1) {
-			struct ext2_inode *inode;
-			inode = (struct ext2_inode *)
-			            (inode_table + i * EXT2_INODE_SIZE(&c->sb));
-			ext2_ino_t inode_nr = first_inode + i + 1;
-			/* +1 because we start counting inodes at 1
-			 * for convention.
-			 */
-			printf("At inode %u of %u\r", inode_nr,
-			                                  c->sb.s_inodes_count);
-			ret = parse_inode(c, inode_nr, inode);
-			if (ret < 0)
-				return -1;
-			count++;
+	for (i = find_next_set_bit(bitmap, nr_inodes, 0);
+	     i < nr_inodes;
+	     i = find_next_set_bit(bitmap, nr_inodes, i + 1)) {
+		struct ext2_inode *inode;
+		inode = (struct ext2_inode *)
+		            (inode_table + i * EXT2_INODE_SIZE(&c->sb));
+		ext2_ino_t inode_nr = first_inode + i + 1;
+		/* +1 because we start counting inodes at 1
+		 * for convention.
+		 */
+		ret = parse_inode(c, inode_nr, inode);
+		if (ret < 0) {
+			munmap(bitmap - bitmap_delta_offset, bitmap_length);
+			return -1;
 		}
-		bitmap[i / CHAR_BIT] >>= 1;
+		count++;
 	}
-	printf("\n");
 	munmap(bitmap - bitmap_delta_offset, bitmap_length);
 	return count;
 }
@@ -243,17 +298,27 @@ void close_drive(struct defrag_ctx *c)
 		}
 	}
 	free(c->bg_maps);
-	for (i = 0; i < c->sb.s_inodes_count; i++) {
-		if (!c->inodes[i])
+	for (i = 0; i < ext2_groups_on_disk(&c->sb); i++) {
+		struct inode **table = c->inode_tables[i];
+		int j;
+		if (!table)
 			continue;
-		if (c->inodes[i]->metadata)
-			free(c->inodes[i]->metadata);
-		if (c->inodes[i]->data)
-			free(c->inodes[i]->data);
-		if (c->inodes[i]->num_sparse)
-			free(c->inodes[i]->sparse);
-		free(c->inodes[i]);
+		for (j = 0; j < EXT2_INODES_PER_GROUP(&c->sb); j++) {
+			if (!table[j])
+				continue;
+			if (table[j]->metadata)
+				free(table[j]->metadata);
+			if (table[j]->data)
+				free(table[j]->data);
+			if (table[j]->num_sparse)
+				free(table[j]->sparse);
+		}
+		free(table);
 	}
+	free(c->inode_tables);
+	free(c->live_inodes);
+	free(c->lazy.scanned);
+	slab_destroy(&c->inode_slab);
 	c->gd_map = PAGE_START(c->gd_map);
 	i = munmap(c->gd_map, c->map_length);
 	if (i < 0) {
@@ -262,13 +327,16 @@ void close_drive(struct defrag_ctx *c)
 		printf("Params: %p %ld\n", c->gd_map, c->map_length);
 	}
 
-	while (c->free_tree_by_size.rb_node) {
-		struct free_extent *f;
-		f = rb_entry(c->free_tree_by_size.rb_node,
-		             struct free_extent, size_rb);
-		rb_erase(c->free_tree_by_size.rb_node, &c->free_tree_by_size);
-		free(f);
-	}
+	/* The free extents are released in bulk with their slab */
+	c->free_tree_by_size = RB_ROOT;
+	c->free_tree_by_block = RB_ROOT;
+	slab_destroy(&c->free_extent_slab);
+	free(c->group_free);
+#ifdef BTREE_INDEX
+	btree_destroy(&c->extents_index);
+	btree_destroy(&c->free_index);
+#endif
+	cache_destroy(c);
 	close(c->fd);
 	free(c);
 }
@@ -308,6 +376,9 @@ long add_uninit_bg(struct defrag_ctx *c, struct ext2_group_desc *gd,
 		}
 	}
 	ret = write_block(c, bitmap, gd->bg_block_bitmap);
+	if (ret)
+		return ret;
+	ret = cache_flush(c);
 	if (ret)
 		return ret;
 	ret = fsync(c->fd);
@@ -331,17 +402,40 @@ long add_uninit_bg(struct defrag_ctx *c, struct ext2_group_desc *gd,
 	return 0;
 }
 
-long parse_free_bitmap(struct defrag_ctx *c, blk64_t bitmap_block,
-                       int group_nr)
+/* Returns the number of blocks in the given range that are not part of any
+ * inode's data or metadata (e.g. bitmaps and inode tables).
+ */
+static e2_blkcnt_t count_unowned_blocks(struct defrag_ctx *c, blk64_t block,
+                                        e2_blkcnt_t count)
+{
+	blk64_t end = block + count;
+	e2_blkcnt_t ret = 0;
+
+	while (block < end) {
+		struct data_extent *e;
+		blk64_t next;
+		e = containing_data_extent(c, block);
+		if (e) {
+			block = e->end_block + 1;
+			continue;
+		}
+		e = data_extent_after(c, block);
+		if (e && e->start_block < end)
+			next = e->start_block;
+		else
+			next = end;
+		ret += next - block;
+		block = next;
+	}
+	return ret;
+}
+
+static int map_block_bitmap(struct defrag_ctx *c, blk64_t bitmap_block,
+                            int group_nr)
 {
 	unsigned char *bitmap;
 	off_t start_offset, delta_offset;
 	size_t map_length;
-	blk64_t first_block = group_nr * c->sb.s_blocks_per_group;
-	first_block += c->sb.s_first_data_block;
-	struct free_extent *free_extent;
-	struct data_extent *file_extent = NULL;
-	long count = 0;
 	int i;
 
 	start_offset = bitmap_block * EXT2_BLOCK_SIZE(&c->sb);
@@ -363,99 +457,435 @@ long parse_free_bitmap(struct defrag_ctx *c, blk64_t bitmap_block,
 	c->bg_maps[group_nr].bitmap = bitmap;
 	c->bg_maps[group_nr].bitmap_map_length = map_length;
 	c->bg_maps[group_nr].bitmap_offset = delta_offset;
+	return 0;
+}
 
-	free_extent = containing_free_extent(c, first_block - 1);
-	if (free_extent)
-		rb_remove_free_extent(c, free_extent);
-	for (i = 0; i < c->sb.s_blocks_per_group; i += CHAR_BIT) {
-		int j;
-		unsigned char mask = 1;
-		if (file_extent
-		    && file_extent->end_block > i + first_block + CHAR_BIT - 1)
-			continue;
-		if (bitmap[i / CHAR_BIT] == 0) {
-			if (!free_extent) {
-				free_extent=malloc(sizeof(struct free_extent));
-				if (!free_extent)
-					return -1;
-				free_extent->start_block = first_block + i;
-			}
-			free_extent->end_block = first_block + i + CHAR_BIT - 1;
+/* Appends the free blocks start to end to list, continuing *last if they
+ * follow right after it. A last extent too small to index is reused
+ * instead. *last is updated to the extent that holds the blocks.
+ */
+int append_free_run(struct defrag_ctx *c, struct obstack *list,
+                    struct free_extent **last, blk64_t start, blk64_t end)
+{
+	struct free_extent *free_extent = *last;
+
+	if (!free_extent || free_extent->end_block != start - 1) {
+		if (!free_extent || free_extent_indexed(free_extent->end_block
+		                                + 1 - free_extent->start_block)) {
+			free_extent = slab_alloc(&c->free_extent_slab);
+			if (!free_extent)
+				return -1;
+			obstack_ptr_grow(list, free_extent);
+		}
+		free_extent->start_block = start;
+	}
+	free_extent->end_block = end;
+	*last = free_extent;
+	return 0;
+}
+
+/* Appends pointers to the free extents in the bitmap of a group to list,
+ * in ascending order. *last is the last extent found before, which is
+ * continued if the group starts with free blocks; it is updated to the last
+ * extent found in this group. Returns the number of used blocks that are not
+ * owned by any inode, or -1 on error.
+ */
+static long collect_free_extents(struct defrag_ctx *c, int group_nr,
+                                 struct obstack *list,
+                                 struct free_extent **last)
+{
+	unsigned char *bitmap = c->bg_maps[group_nr].bitmap;
+	blk64_t first_block = group_nr * c->sb.s_blocks_per_group;
+	first_block += c->sb.s_first_data_block;
+	unsigned long bit, next, nr_bits;
+	long count = 0;
+
+	nr_bits = c->sb.s_blocks_per_group;
+	if (first_block + nr_bits > c->sb.s_blocks_count)
+		nr_bits = c->sb.s_blocks_count - first_block;
+
+	for (bit = 0; bit < nr_bits; bit = next) {
+		next = find_next_set_bit(bitmap, nr_bits, bit);
+		if (next > bit) {
+			if (append_free_run(c, list, last, first_block + bit,
+			                    first_block + next - 1) < 0)
+				return -1;
 			continue;
 		}
-		for (j = 0; j < CHAR_BIT; j++) {
-			blk64_t block = first_block + i + j;
-			if (file_extent && file_extent->end_block > block) {
-				mask <<= 1;
-				continue;
-			}
-			if (block >= c->sb.s_blocks_count)
-				break;
-			if (bitmap[i / CHAR_BIT] & mask) {
-				if (free_extent) {
-					insert_free_extent(c, free_extent);
-					free_extent = NULL;
-				}
-				file_extent = containing_data_extent(c, block);
-				if (file_extent) {
-					mask <<= 1;
-					continue;
-				}
-				count++;
-			} else {
-				if (!free_extent) {
-					free_extent = malloc(
-						    sizeof(struct free_extent));
-					if (!free_extent)
-						return -1;
-					free_extent->start_block = block;
-				}
-				free_extent->end_block = block;
-			}
-			mask <<= 1;
+		next = find_next_zero_bit(bitmap, nr_bits, bit);
+		count += count_unowned_blocks(c, first_block + bit, next - bit);
+	}
+	return count;
+}
+
+/* Adds the free space of one group to the free space indexes, merging with
+ * the free extents of neighbouring groups that are already known.
+ */
+long parse_free_bitmap(struct defrag_ctx *c, int group_nr)
+{
+	blk64_t first_block = group_nr * c->sb.s_blocks_per_group;
+	first_block += c->sb.s_first_data_block;
+	struct free_extent *last, *after, **extents;
+	struct obstack list;
+	long count;
+	size_t i, n;
+
+	obstack_init(&list);
+	/* A free extent at the end of the previous group is continued */
+	last = containing_free_extent(c, first_block - 1);
+	if (last) {
+		rb_remove_free_extent(c, last);
+		obstack_ptr_grow(&list, last);
+	}
+	count = collect_free_extents(c, group_nr, &list, &last);
+	n = obstack_object_size(&list) / sizeof(*extents);
+	extents = obstack_finish(&list);
+	if (last) {
+		/* The next group may already be known in single inode mode */
+		after = containing_free_extent(c, last->end_block + 1);
+		if (after) {
+			rb_remove_free_extent(c, after);
+			last->end_block = after->end_block;
+			slab_free(&c->free_extent_slab, after);
 		}
 	}
-	if (free_extent)
-		insert_free_extent(c, free_extent);
+	for (i = 0; i < n; i++)
+		insert_free_extent(c, extents[i]);
+	obstack_free(&list, NULL);
 	return count;
 }
 
-int set_e2_filesystem_data(struct defrag_ctx *c)
+/* Fills the empty free space indexes. The free extents of a group are
+ * taken from the state file if its bitmap did not change since, and parsed
+ * from the bitmap otherwise.
+ */
+static long parse_all_free_bitmaps(struct defrag_ctx *c, int num_groups)
 {
-	int num_block_groups = (c->sb.s_blocks_count
-	                        + c->sb.s_blocks_per_group - 1)
-	                       / c->sb.s_blocks_per_group;
-	struct ext2_group_desc *gds;
+	struct free_extent *last = NULL, **extents;
+	struct obstack list;
+	long count = 0, ret;
+	size_t n;
 	int i;
-	gds = (struct ext2_group_desc *)c->gd_map;
 
-	for (i = 0; i < num_block_groups; i++) {
-		long ret = 0;
+	obstack_init(&list);
+	for (i = 0; i < num_groups && count >= 0; i++) {
+		ret = restore_group_free_space(c, i, &list, &last);
+		if (ret > 0)
+			ret = collect_free_extents(c, i, &list, &last);
+		count = ret < 0 ? ret : count + ret;
+	}
+	n = obstack_object_size(&list) / sizeof(*extents);
+	extents = obstack_finish(&list);
+	if (last && !free_extent_indexed(last->end_block + 1
+	                                 - last->start_block)) {
+		slab_free(&c->free_extent_slab, last);
+		n--;
+	}
+	if (count >= 0 && build_free_trees(c, extents, n) < 0)
+		count = -1;
+	obstack_free(&list, NULL);
+	return count;
+}
+
+/* Work queue shared by the inode table parsing threads. Every thread
+ * takes the next unparsed block group from the queue until none are left
+ * or one of them fails. The progress is printed under the lock as well.
+ */
+struct parse_queue {
+	struct defrag_ctx *c;
+	pthread_mutex_t lock;
+	int next_group;
+	int num_groups;
+	int error;
+	unsigned long inodes_done;
+};
+
+static void group_done(struct parse_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->inodes_done += q->c->sb.s_inodes_per_group;
+	printf("At inode %lu of %u\r", q->inodes_done,
+	       q->c->sb.s_inodes_count);
+	fflush(stdout);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void *parse_inode_tables(void *arg)
+{
+	struct parse_queue *q = arg;
+	struct defrag_ctx *c = q->c;
+	struct ext2_group_desc *gds = (struct ext2_group_desc *)c->gd_map;
+
+	while (1) {
+		long ret;
+		int i;
+		pthread_mutex_lock(&q->lock);
+		if (q->error || q->next_group >= q->num_groups) {
+			pthread_mutex_unlock(&q->lock);
+			return NULL;
+		}
+		i = q->next_group++;
+		pthread_mutex_unlock(&q->lock);
+
 		if ((gds[i].bg_flags & (EXT2_BG_INODE_UNINIT))
 		    || gds[i].bg_free_inodes_count == c->sb.s_inodes_per_group){
+			group_done(q);
 			continue;
 		}
+		errno = 0;
 		ret = parse_inode_table(c, gds[i].bg_inode_bitmap,
 		                        gds[i].bg_inode_table, i);
-		if (ret < 0)
+		if (ret < 0) {
+			pthread_mutex_lock(&q->lock);
+			q->error = errno ? errno : EIO;
+			pthread_mutex_unlock(&q->lock);
+			return NULL;
+		}
+		group_done(q);
+	}
+}
+
+/* Parses the inode tables of all block groups, using up to
+ * global_settings.nr_threads threads. The inodes are only stored in the
+ * per-group c->inode_tables; the live inode list and the extent trees are
+ * built afterwards by the caller.
+ */
+static int parse_all_inode_tables(struct defrag_ctx *c, int num_block_groups)
+{
+	pthread_t threads[MAX_THREADS];
+	struct parse_queue q = {
+		.c = c,
+		.next_group = 0,
+		.num_groups = num_block_groups,
+		.error = 0,
+		.inodes_done = 0,
+	};
+	long nr_threads = global_settings.nr_threads;
+	int i, started;
+
+	if (nr_threads == 0)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads > MAX_THREADS)
+		nr_threads = MAX_THREADS;
+	if (nr_threads > num_block_groups)
+		nr_threads = num_block_groups;
+	pthread_mutex_init(&q.lock, NULL);
+	/* The calling thread is a worker as well */
+	for (started = 0; started < nr_threads - 1; started++) {
+		if (pthread_create(&threads[started], NULL,
+		                   parse_inode_tables, &q))
+			break;
+	}
+	parse_inode_tables(&q);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	printf("\n");
+	pthread_mutex_destroy(&q.lock);
+	if (q.error) {
+		errno = q.error;
+		return -1;
+	}
+	return 0;
+}
+
+static int insert_inode_extents(struct defrag_ctx *c)
+{
+	struct data_extent **extents;
+	size_t count = 0;
+	ext2_ino_t i;
+	int j, ret;
+
+	for (i = 0; i < c->nr_live_inodes; i++) {
+		struct inode *inode = get_inode(c, c->live_inodes[i]);
+		count += inode->data->extent_count;
+		if (inode->metadata)
+			count += inode->metadata->extent_count;
+	}
+	extents = malloc((count ? count : 1) * sizeof(*extents));
+	if (!extents)
+		return -1;
+	count = 0;
+	for (i = 0; i < c->nr_live_inodes; i++) {
+		struct inode *inode = get_inode(c, c->live_inodes[i]);
+		for (j = 0; j < inode->data->extent_count; j++)
+			extents[count++] = &inode->data->extents[j];
+		for (j = 0; inode->metadata
+		            && j < inode->metadata->extent_count; j++)
+			extents[count++] = &inode->metadata->extents[j];
+	}
+	ret = build_data_extent_trees(c, extents, count);
+	free(extents);
+	return ret;
+}
+
+/* Makes the block bitmap of a group available, initializing it first if
+ * the group is marked uninitialized.
+ */
+static int prepare_block_bitmap(struct defrag_ctx *c, int group_nr)
+{
+	struct ext2_group_desc *gd;
+	int ret = 0;
+
+	gd = &((struct ext2_group_desc *)c->gd_map)[group_nr];
+	if (gd->bg_flags & EXT2_BG_BLOCK_UNINIT)
+		ret = add_uninit_bg(c, gd, group_nr);
+	if (!ret)
+		ret = map_block_bitmap(c, gd->bg_block_bitmap, group_nr);
+	return ret;
+}
+
+static int scan_group_free_space(struct defrag_ctx *c, int group_nr)
+{
+	if (c->lazy.scanned[group_nr])
+		return 0;
+	c->lazy.scanned[group_nr] = 1;
+	if (prepare_block_bitmap(c, group_nr) < 0)
+		return -1;
+	return parse_free_bitmap(c, group_nr) < 0 ? -1 : 0;
+}
+
+/* In single inode mode the free space is only known for the groups scanned
+ * so far. Scans further groups, closest to the inode's group first, until a
+ * free extent of at least num_blocks blocks is known or every group has
+ * been scanned.
+ */
+int ensure_free_space(struct defrag_ctx *c, e2_blkcnt_t num_blocks)
+{
+	const int num_groups = ext2_groups_on_disk(&c->sb);
+
+	if (!c->lazy.scanned)
+		return 0;
+	while (c->lazy.step < 2 * num_groups) {
+		struct rb_node *n = rb_last(&c->free_tree_by_size);
+		int group;
+		if (n) {
+			struct free_extent *f;
+			f = rb_entry(n, struct free_extent, size_rb);
+			if (f->end_block - f->start_block + 1 >= num_blocks)
+				return 0;
+		}
+		/* Alternate between the groups after and before it */
+		group = c->lazy.home_group;
+		if (c->lazy.step % 2)
+			group += c->lazy.step / 2 + 1;
+		else
+			group -= c->lazy.step / 2;
+		c->lazy.step++;
+		if (group < 0 || group >= num_groups)
+			continue;
+		if (scan_group_free_space(c, group) < 0)
 			return -1;
 	}
+	return 0;
+}
 
-	for (i = 0; i < num_block_groups; i++) {
-		long ret = 0;
-		if (!(gds[i].bg_flags & EXT2_BG_BLOCK_UNINIT)) {
-			ret = parse_free_bitmap(c, gds[i].bg_block_bitmap, i);
-		} else {
-			ret = add_uninit_bg(c, &gds[i], i);
-			if (!ret) {
-				ret = parse_free_bitmap(c,
-				                        gds[i].bg_block_bitmap,
-				                        i);
-			}
+static int scan_alloc_groups(struct defrag_ctx *c, struct allocation *alloc)
+{
+	e2_blkcnt_t i;
+	for (i = 0; alloc && i < alloc->extent_count; i++) {
+		blk64_t block = alloc->extents[i].start_block;
+		while (block <= alloc->extents[i].end_block) {
+			int group = (block - c->sb.s_first_data_block)
+			            / c->sb.s_blocks_per_group;
+			if (scan_group_free_space(c, group) < 0)
+				return -1;
+			block = (group + 1) * (blk64_t)c->sb.s_blocks_per_group
+			        + c->sb.s_first_data_block;
 		}
-		if (ret < 0)
+	}
+	return 0;
+}
+
+/* Single inode mode: only the inode itself is parsed, and the free space of
+ * the groups holding its blocks. More groups are scanned on demand by
+ * ensure_free_space().
+ */
+static int set_single_inode_data(struct defrag_ctx *c, ext2_ino_t inode_nr)
+{
+	const ext2_ino_t per_group = EXT2_INODES_PER_GROUP(&c->sb);
+	struct ext2_group_desc *gd;
+	unsigned char *inode_table, *bitmap;
+	struct inode *inode;
+	int group, index;
+
+	if (inode_nr == 0 || inode_nr > c->sb.s_inodes_count) {
+		errno = EINVAL;
+		return -1;
+	}
+	group = (inode_nr - 1) / per_group;
+	index = (inode_nr - 1) % per_group;
+	gd = &((struct ext2_group_desc *)c->gd_map)[group];
+	c->lazy.scanned = calloc(ext2_groups_on_disk(&c->sb), 1);
+	if (!c->lazy.scanned)
+		return -1;
+	c->lazy.home_group = group;
+
+	if (!(gd->bg_flags & EXT2_BG_INODE_UNINIT)) {
+		bitmap = malloc(EXT2_BLOCK_SIZE(&c->sb));
+		if (!bitmap)
+			return -1;
+		if (read_block(c, bitmap, gd->bg_inode_bitmap) < 0) {
+			free(bitmap);
 			return -1;
+		}
+		if (bitmap[index / CHAR_BIT] & (1 << (index % CHAR_BIT))) {
+			inode_table = map_inode_table(c, gd->bg_inode_table,
+			                              group);
+			if (!inode_table || parse_inode(c, inode_nr,
+			             (struct ext2_inode *)(inode_table
+			                     + index * EXT2_INODE_SIZE(&c->sb))))
+			{
+				free(bitmap);
+				return -1;
+			}
+		}
+		free(bitmap);
 	}
+	if (index_live_inodes(c) < 0 || insert_inode_extents(c) < 0)
+		return -1;
 
+	inode = get_inode(c, inode_nr);
+	if (inode) {
+		if (inode->data->extent_count)
+			c->lazy.home_group = (inode->data->extents[0].start_block
+			                      - c->sb.s_first_data_block)
+			                     / c->sb.s_blocks_per_group;
+		if (scan_alloc_groups(c, inode->data) < 0
+		    || scan_alloc_groups(c, inode->metadata) < 0)
+			return -1;
+	}
+	if (scan_group_free_space(c, c->lazy.home_group) < 0)
+		return -1;
+	drop_state(c);
 	return 0;
 }
+
+int set_e2_filesystem_data(struct defrag_ctx *c)
+{
+	int num_block_groups = (c->sb.s_blocks_count
+	                        + c->sb.s_blocks_per_group - 1)
+	                       / c->sb.s_blocks_per_group;
+	int i, ret;
+
+	if (global_settings.state_file) {
+		ret = load_state(c, global_settings.state_file);
+		if (ret < 0 && errno != ENOENT)
+			printf("Ignoring state file %s: %s\n",
+			       global_settings.state_file, strerror(errno));
+	}
+	if (global_settings.single_inode)
+		return set_single_inode_data(c, global_settings.single_inode);
+	if (parse_all_inode_tables(c, num_block_groups) < 0)
+		return -1;
+	if (index_live_inodes(c) < 0 || insert_inode_extents(c) < 0)
+		return -1;
+
+	for (i = 0; i < num_block_groups; i++) {
+		if (prepare_block_bitmap(c, i) < 0)
+			return -1;
+	}
+	ret = parse_all_free_bitmaps(c, num_block_groups) < 0 ? -1 : 0;
+	drop_state(c);
+
+	return ret < 0 ? -1 : 0;
+}
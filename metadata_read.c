@@ -101,18 +101,41 @@ static int do_blocks(struct tmp_extent *first_extent,
 	}
 }
 
+/* Reads the blocks referenced by the indirect block ind in a single batch.
+ * Sparse entries are skipped, and since every child that is walked counts
+ * as one of the nblocks blocks left, no more than nblocks are read.
+ * Returns a malloc'ed buffer with the blocks in order, or NULL on error.
+ */
+static __u32 *read_ind_children(struct defrag_ctx *c, const __u32 *ind,
+                                __u32 nblocks)
+{
+	const int addr_per_block = EXT2_ADDR_PER_BLOCK(&c->sb);
+	blk64_t blocks[addr_per_block];
+	__u32 *ret;
+	int i, count = 0;
+
+	for (i = 0; i < addr_per_block && count < nblocks; i++)
+		if (ind[i])
+			blocks[count++] = ind[i];
+	ret = malloc((count ? count : 1) * EXT2_BLOCK_SIZE(&c->sb));
+	if (!ret)
+		return NULL;
+	if (read_blocks(c, ret, blocks, count)) {
+		free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+/* The do_*_block functions get the contents of the (already read) indirect
+ * block, or NULL if it is sparse.
+ */
 static int do_ind_block(struct defrag_ctx *c, struct tmp_extent *first_extent,
                        struct tmp_extent **last_extent, struct obstack *mempool,
-                       blk64_t block, blk64_t logical_block, __u32 *nblocks)
+                       const __u32 *ind, blk64_t logical_block, __u32 *nblocks)
 {
 	int count = 0, i;
-	__u32 ind[EXT2_ADDR_PER_BLOCK(&c->sb)];
-	if (block) {
-		i = read_block(c, ind, block);
-		if (i) {
-			obstack_free(mempool, NULL);
-			return -1;
-		}
+	if (ind) {
 		for (i = 0;
 		     i < EXT2_ADDR_PER_BLOCK(&c->sb) && *nblocks;
 		     i++, logical_block++) {
@@ -132,35 +155,36 @@ static int do_ind_block(struct defrag_ctx *c, struct tmp_extent *first_extent,
 
 static long do_dind_block(struct defrag_ctx *c, struct tmp_extent *first_extent,
                        struct tmp_extent **last_extent, struct obstack *mempool,
-                       blk64_t block, blk64_t logical_block, __u32 *nblocks)
+                       const __u32 *dind, blk64_t logical_block,
+                       __u32 *nblocks)
 {
+	const int addr_per_block = EXT2_ADDR_PER_BLOCK(&c->sb);
 	blk64_t old_logical_block = logical_block;
+	__u32 *ind, *next;
 	int i;
-	__u32 ind[EXT2_ADDR_PER_BLOCK(&c->sb)];
-	if (block) {
-		i = read_block(c, ind, block);
-		if (i) {
+	if (dind) {
+		ind = read_ind_children(c, dind, *nblocks);
+		if (!ind) {
 			obstack_free(mempool, NULL);
 			return -1;
 		}
-		for (i = 0; i < EXT2_ADDR_PER_BLOCK(&c->sb) && *nblocks; i++) {
+		next = ind;
+		for (i = 0; i < addr_per_block && *nblocks; i++) {
 			int tmp;
 			*nblocks -= do_blocks(first_extent, last_extent,
-			                      mempool, ind[i], logical_block,1,
+			                      mempool, dind[i], logical_block,1,
 			                      0);
 			logical_block++;
 			tmp = do_ind_block(c, first_extent, last_extent,
-			                   mempool, ind[i], logical_block,
-			                   nblocks);
-			if (tmp >= 0) {
-				logical_block += tmp;
-			} else {
-				obstack_free(mempool, NULL);
-				return tmp;
-			}
+			                   mempool, dind[i] ? next : NULL,
+			                   logical_block, nblocks);
+			if (dind[i])
+				next += addr_per_block;
+			logical_block += tmp;
 		}
+		free(ind);
 	} else {
-		e2_blkcnt_t numblocks = EXT2_ADDR_PER_BLOCK(&c->sb);
+		e2_blkcnt_t numblocks = addr_per_block;
 		numblocks = numblocks + (numblocks * numblocks);
 		/* n indirect blocks, plus n*n data blocks */
 		add_sparse(first_extent->last_sparse, logical_block, numblocks,
@@ -172,35 +196,41 @@ static long do_dind_block(struct defrag_ctx *c, struct tmp_extent *first_extent,
 
 static long do_tind_block(struct defrag_ctx *c, struct tmp_extent *first_extent,
                        struct tmp_extent **last_extent, struct obstack *mempool,
-                       blk64_t block, blk64_t logical_block, __u32 *nblocks)
+                       const __u32 *tind, blk64_t logical_block,
+                       __u32 *nblocks)
 {
+	const int addr_per_block = EXT2_ADDR_PER_BLOCK(&c->sb);
 	blk64_t old_logical_block = logical_block;
+	__u32 *dind, *next;
 	int i;
-	__u32 ind[EXT2_ADDR_PER_BLOCK(&c->sb)];
-	if (block) {
-		i = read_block(c, ind, block);
-		if (i) {
+	if (tind) {
+		dind = read_ind_children(c, tind, *nblocks);
+		if (!dind) {
 			obstack_free(mempool, NULL);
 			return -1;
 		}
-		for (i = 0; i < EXT2_ADDR_PER_BLOCK(&c->sb) && *nblocks; i++) {
+		next = dind;
+		for (i = 0; i < addr_per_block && *nblocks; i++) {
 			long tmp;
 			*nblocks -= do_blocks(first_extent, last_extent,
-			                      mempool, ind[i], logical_block,1,
+			                      mempool, tind[i], logical_block,1,
 			                      0);
 			logical_block++;
 			tmp = do_dind_block(c, first_extent, last_extent,
-			                    mempool, ind[i], logical_block,
-			                    nblocks);
+			                    mempool, tind[i] ? next : NULL,
+			                    logical_block, nblocks);
+			if (tind[i])
+				next += addr_per_block;
 			if (tmp >= 0) {
 				logical_block += tmp;
 			} else {
-				obstack_free(mempool, NULL);
+				free(dind);
 				return tmp;
 			}
 		}
+		free(dind);
 	} else {
-		e2_blkcnt_t numblocks = EXT2_ADDR_PER_BLOCK(&c->sb);
+		e2_blkcnt_t numblocks = addr_per_block;
 		numblocks = numblocks
 		            + (numblocks * numblocks)
 			    + (numblocks * numblocks * numblocks);
@@ -252,20 +282,20 @@ static struct inode *make_inode_extents(struct defrag_ctx *c,
 		i += 1;
 		tmp = tmp->next;
 	}
-	ret = malloc(sizeof(struct inode));
+	ret = slab_alloc(&c->inode_slab);
 	if (!ret)
 		return NULL;
 	ret->data = malloc(sizeof(struct allocation) +
 	                   sizeof(struct data_extent) * i);
 	if (!ret->data) {
-		free(ret);
+		slab_free(&c->inode_slab, ret);
 		return NULL;
 	}
 	if (first_sparse) {
 		retval = set_inode_sparse(ret, first_sparse);
 		if (retval) {
 			free(ret->data);
-			free(ret);
+			slab_free(&c->inode_slab, ret);
 			return NULL;
 		}
 	}
@@ -284,7 +314,6 @@ static struct inode *make_inode_extents(struct defrag_ctx *c,
 			blk64_t next_logical;
 			next_logical = tmp->next->e.start_logical;
 		}
-		insert_data_extent(c, ret->data->extents + i);
 	}
 	return ret;
 }
@@ -317,44 +346,56 @@ static int read_extent_leaf(struct tmp_extent *first_extent,
 	return 0;
 }
 
+/* Walks the extent tree below header once, adding the data extents to the
+ * data list and the index/leaf blocks themselves to the metadata list.
+ * All children of an index node are read in one batch.
+ */
 static int read_extent_index(struct defrag_ctx *c,
                              struct tmp_extent *first_extent,
                              struct tmp_extent **last_extent,
+                             struct tmp_extent *first_metadata,
+                             struct tmp_extent **last_metadata,
                              struct obstack *mempool,
 			     struct ext3_extent_header *header,
-                             e2_blkcnt_t *metadata_only)
+                             e2_blkcnt_t *num_metadata)
 {
 	struct ext3_extent_idx *extents = (struct ext3_extent_idx *)(header+1);
-	int i, ret;
+	const int block_size = EXT2_BLOCK_SIZE(&c->sb);
+	unsigned char *buffer;
+	int i, ret = 0;
 	if (header->eh_magic != EXT3_EXT_MAGIC) {
 		printf("Inode has unknown type of extents, ignoring.");
 		return 0;
 	}
-	for (i = 0; i < header->eh_entries; i++) {
-		unsigned char buffer[EXT2_BLOCK_SIZE(&c->sb)];
-		struct ext3_extent_header *new_header = (void *)buffer;
-		if (metadata_only) {
-			ret = do_blocks(first_extent, last_extent, mempool,
-			                EI_BLOCK(&extents[i]),
-			                (*metadata_only)++, 1, 0);
-			if (ret < 0)
-				return ret;
-		}
-		ret = read_block(c, buffer, EI_BLOCK(&extents[i]));
+	if (header->eh_entries == 0)
+		return 0;
+	buffer = malloc(header->eh_entries * block_size);
+	if (!buffer)
+		return -1;
+	{
+		blk64_t blocks[header->eh_entries];
+		for (i = 0; i < header->eh_entries; i++)
+			blocks[i] = EI_BLOCK(&extents[i]);
+		ret = read_blocks(c, buffer, blocks, header->eh_entries);
+	}
+	for (i = 0; i < header->eh_entries && ret >= 0; i++) {
+		struct ext3_extent_header *new_header;
+		new_header = (void *)(buffer + i * block_size);
+		ret = do_blocks(first_metadata, last_metadata, mempool,
+		                EI_BLOCK(&extents[i]), (*num_metadata)++, 1, 0);
 		if (ret < 0)
-			return ret;
-		if (new_header->eh_depth == 0 && !metadata_only)
+			break;
+		if (new_header->eh_depth == 0)
 			ret = read_extent_leaf(first_extent, last_extent,
 			                       mempool, new_header);
-		else if (new_header->eh_depth > 0) {
+		else
 			ret = read_extent_index(c, first_extent, last_extent,
+			                        first_metadata, last_metadata,
 			                        mempool, new_header,
-			                        metadata_only);
-		}
-		if (ret < 0)
-			return ret;
+			                        num_metadata);
 	}
-	return 0;
+	free(buffer);
+	return ret < 0 ? ret : 0;
 }
 static int gen_inode_sparse(struct inode *inode)
 {
@@ -439,62 +480,57 @@ static struct inode *read_inode_extents(struct defrag_ctx *c,
 			ret->on_disk = (union on_disk_block *)inode->i_block;
 			ret->metadata = malloc(sizeof(*ret->metadata));
 			if (!ret->metadata) {
-				free(ret);
+				slab_free(&c->inode_slab, ret);
 				goto out_error;
 			}
 			ret->metadata->block_count = 0;
 			ret->metadata->extent_count = 0;
 		}
 	} else {
+		struct tmp_extent first_metadata = {
+			.e = {0, 0, 0, 0},
+			.last_sparse = NULL,
+			.next = NULL
+		};
+		struct tmp_extent *last_metadata = NULL;
+		e2_blkcnt_t num_extents = 0, i;
 		int tmp;
 		tmp = read_extent_index(c, &first_extent, &last_extent,
-		                        &mempool, header, NULL);
+		                        &first_metadata, &last_metadata,
+		                        &mempool, header,
+		                        &num_metadata_blocks);
 		if (tmp < 0)
 			goto out_error;
 		ret = make_inode_extents(c, &first_extent, NULL, inode_nr);
 		if (ret) {
-			e2_blkcnt_t num_extents = 0, i;
 			ret->on_disk = (union on_disk_block *)inode->i_block;
-			first_extent.e.start_block = 0;
-			first_extent.e.end_block = 0;
-			first_extent.e.start_logical = 0;
-			first_extent.next = NULL;
-			first_extent.last_sparse = NULL;
-			last_extent = NULL;
-			tmp = read_extent_index(c, &first_extent, &last_extent,
-			                        &mempool, header,
-			                        &num_metadata_blocks);
-			if (tmp < 0) {
-				free(ret);
-				goto out_error;
-			}
-			last_extent = &first_extent;
-			while (last_extent) {
+			if (last_metadata)
+				last_metadata = &first_metadata;
+			while (last_metadata) {
 				num_extents++;
-				last_extent = last_extent->next;
+				last_metadata = last_metadata->next;
 			}
 			ret->metadata = malloc(sizeof(*ret->metadata)
 			                       + num_extents
 			                          * sizeof(struct data_extent));
 			if (!ret->metadata) {
-				free(ret);
+				slab_free(&c->inode_slab, ret);
 				goto out_error;
 			}
 			ret->metadata->block_count = num_metadata_blocks;
 			ret->metadata->extent_count = num_extents;
-			last_extent = &first_extent;
+			last_metadata = &first_metadata;
 			for (i = 0; i < num_extents; i++) {
-				ret->metadata->extents[i] = last_extent->e;
+				ret->metadata->extents[i] = last_metadata->e;
 				ret->metadata->extents[i].inode_nr = inode_nr;
-				last_extent = last_extent->next;
-				insert_data_extent(c,ret->metadata->extents +i);
+				last_metadata = last_metadata->next;
 			}
 		}
 	}
 	if (gen_inode_sparse(ret) < 0) {
 		free(ret->data);
 		free(ret->metadata);
-		free(ret);
+		slab_free(&c->inode_slab, ret);
 		goto out_error;
 	}
 
@@ -506,6 +542,20 @@ out_error:
 	return NULL;
 }
 
+/* Reads a top-level indirect block that was left out of the batch, as it
+ * was not certain that its subtree would be walked.
+ */
+static int read_top_block(struct defrag_ctx *c, __u32 **top, __u32 *buf,
+                          __u32 block)
+{
+	blk64_t b = block;
+
+	if (*top || !block)
+		return 0;
+	*top = buf;
+	return read_blocks(c, buf, &b, 1);
+}
+
 static struct inode *read_inode_blocks(struct defrag_ctx *c,
                                        ext2_ino_t inode_nr,
                                        struct ext2_inode *inode)
@@ -525,7 +575,17 @@ static struct inode *read_inode_blocks(struct defrag_ctx *c,
 	__u32 logical_block = 0;
 	__u32 nblocks = inode->i_blocks / EXT2_SECTORS_PER_BLOCK(&c->sb);
 	__u32 *blocks = inode->i_block;
-	int i;
+	const int addr_per_block = EXT2_ADDR_PER_BLOCK(&c->sb);
+	__u32 ind[3 * addr_per_block];
+	__u32 *top[3] = {NULL, NULL, NULL};
+	/* Blocks the levels before each top-level block can hold */
+	const __u32 before[3] = {
+		0,
+		addr_per_block + 1,
+		2 * addr_per_block + addr_per_block * addr_per_block + 2
+	};
+	blk64_t batch[3];
+	int i, nr_batch = 0;
 
 	obstack_init(&mempool);
 
@@ -533,15 +593,21 @@ static struct inode *read_inode_blocks(struct defrag_ctx *c,
 		nblocks -= do_blocks(&first_extent, &last_extent, &mempool,
 		                     blocks[i], logical_block, 1, 0);
 	}
+	/* Read the top-level indirect blocks that are walked for certain in
+	   one batch. A sparse tree may need the others as well. */
+	for (i = 0; i < 3 && nblocks > before[i]; i++) {
+		if (!blocks[EXT2_IND_BLOCK + i])
+			continue;
+		top[i] = ind + nr_batch * addr_per_block;
+		batch[nr_batch++] = blocks[EXT2_IND_BLOCK + i];
+	}
+	if (nr_batch && read_blocks(c, ind, batch, nr_batch)) {
+		obstack_free(&mempool, NULL);
+		return NULL;
+	}
 	if (nblocks) {
-		long tmp;
-		tmp = do_ind_block(c, &first_extent, &last_extent,
-		                   &mempool, blocks[EXT2_IND_BLOCK],
-		                   logical_block, &nblocks);
-		if (tmp >= 0)
-			logical_block += tmp;
-		else
-			return NULL;
+		logical_block += do_ind_block(c, &first_extent, &last_extent,
+		                     &mempool, top[0], logical_block, &nblocks);
 	}
 	if (nblocks) {
 		long ret;
@@ -557,9 +623,13 @@ static struct inode *read_inode_blocks(struct defrag_ctx *c,
 	}
 	if (nblocks) {
 		long tmp;
+		if (read_top_block(c, &top[1], ind + addr_per_block,
+		                   blocks[EXT2_DIND_BLOCK])) {
+			obstack_free(&mempool, NULL);
+			return NULL;
+		}
 		tmp = do_dind_block(c, &first_extent, &last_extent,
-		                    &mempool, blocks[EXT2_DIND_BLOCK],
-		                    logical_block, &nblocks);
+		                    &mempool, top[1], logical_block, &nblocks);
 		if (tmp >= 0)
 			logical_block += tmp;
 		else
@@ -579,9 +649,13 @@ static struct inode *read_inode_blocks(struct defrag_ctx *c,
 	}
 	if (nblocks) {
 		long tmp;
+		if (read_top_block(c, &top[2], ind + 2 * addr_per_block,
+		                   blocks[EXT2_TIND_BLOCK])) {
+			obstack_free(&mempool, NULL);
+			return NULL;
+		}
 		tmp = do_tind_block(c, &first_extent, &last_extent,
-		                    &mempool, blocks[EXT2_TIND_BLOCK],
-		                    logical_block, &nblocks);
+		                    &mempool, top[2], logical_block, &nblocks);
 		if (tmp >= 0)
 			logical_block += tmp;
 		else
@@ -597,49 +671,42 @@ static struct inode *read_inode_blocks(struct defrag_ctx *c,
 long parse_inode(struct defrag_ctx *c, ext2_ino_t inode_nr,
                  struct ext2_inode *inode)
 {
+	struct inode *ret;
+
 	if (inode->i_blocks == 0) {
-		c->inodes[inode_nr] = malloc(sizeof(struct inode));
-		if (!c->inodes[inode_nr])
+		ret = slab_alloc(&c->inode_slab);
+		if (!ret)
 			return -1;
-		c->inodes[inode_nr]->data = malloc(sizeof(struct allocation));
-		if (!c->inodes[inode_nr]->data) {
-			free(c->inodes[inode_nr]);
+		ret->data = malloc(sizeof(struct allocation));
+		if (!ret->data) {
+			slab_free(&c->inode_slab, ret);
 			return -1;
 		}
-		c->inodes[inode_nr]->data->block_count = 0;
-		c->inodes[inode_nr]->data->extent_count = 0;
-		c->inodes[inode_nr]->on_disk =
-			                  (union on_disk_block *)inode->i_block;
-		c->inodes[inode_nr]->metadata = NULL;
-		c->inodes[inode_nr]->num_sparse = 0;
-		return 0;
+		ret->data->block_count = 0;
+		ret->data->extent_count = 0;
+		ret->on_disk = (union on_disk_block *)inode->i_block;
+		ret->metadata = NULL;
+		ret->num_sparse = 0;
+		return set_inode(c, inode_nr, ret);
 	}
 	if (inode_nr < EXT2_FIRST_INO(&c->sb)) {
-		if (inode_nr != EXT2_ROOT_INO) {
-			c->inodes[inode_nr] = NULL;
+		if (inode_nr != EXT2_ROOT_INO)
 			return 0;
-		}
 	}
 	if (inode->i_flags - (inode->i_flags & KNOWN_INODE_FLAGS_MASK)) {
 		printf("Inode %u has unknown flags %x. Ignoring the inode\n",
 		       inode_nr,
 		       inode->i_flags & ~KNOWN_INODE_FLAGS_MASK);
-		c->inodes[inode_nr] = NULL;
 		return 0;
 	}
-	if (inode->i_flags & EXT4_EXTENTS_FL) {
-		c->inodes[inode_nr] = read_inode_extents(c, inode_nr, inode);
-		if (c->inodes[inode_nr] == NULL)
-			return -1;
-		else
-			return 0;
-	} else {
-		e2_blkcnt_t blocks;
-		blocks = inode->i_blocks / EXT2_SECTORS_PER_BLOCK(&c->sb);
-		c->inodes[inode_nr] = read_inode_blocks(c, inode_nr, inode);
-		if (c->inodes[inode_nr] != NULL)
-			return 0;
-		else
-			return -1;
-	}
+	ret = restore_inode(c, inode_nr, inode);
+	if (ret)
+		return set_inode(c, inode_nr, ret);
+	if (inode->i_flags & EXT4_EXTENTS_FL)
+		ret = read_inode_extents(c, inode_nr, inode);
+	else
+		ret = read_inode_blocks(c, inode_nr, inode);
+	if (ret == NULL)
+		return -1;
+	return set_inode(c, inode_nr, ret);
 }
@@ -68,7 +68,7 @@ static int write_ind_metadata(struct defrag_ctx *c, struct data_extent *e,
                               __u32 ind_block, __u32 *cur_logical,
                               __u32 *cur_block)
 {
-	struct inode *inode = c->inodes[e->inode_nr];
+	struct inode *inode = get_inode(c, e->inode_nr);
 	__u32 offset = *cur_logical;
 	__u32 ind_blocks = EXT2_ADDR_PER_BLOCK(&c->sb);
 	__u32 blocks_per_ind = 1 + ind_blocks;
@@ -117,7 +117,7 @@ static int write_dind_metadata(struct defrag_ctx *c, struct data_extent *e,
                               __u32 dind_block, __u32 *cur_logical,
                               __u32 *cur_block)
 {
-	struct inode *inode = c->inodes[e->inode_nr];
+	struct inode *inode = get_inode(c, e->inode_nr);
 	__u32 offset = *cur_logical;
 	__u32 ind_blocks = EXT2_ADDR_PER_BLOCK(&c->sb);
 	__u32 blocks_per_ind = 1 + ind_blocks;
@@ -182,7 +182,7 @@ static int write_tind_metadata(struct defrag_ctx *c, struct data_extent *e,
                               __u32 tind_block, __u32 *cur_logical,
                               __u32 *cur_block)
 {
-	struct inode *inode = c->inodes[e->inode_nr];
+	struct inode *inode = get_inode(c, e->inode_nr);
 	__u32 offset = *cur_logical;
 	__u32 ind_blocks = EXT2_ADDR_PER_BLOCK(&c->sb);
 	__u32 blocks_per_ind = 1 + ind_blocks;
@@ -242,7 +242,7 @@ static int write_tind_metadata(struct defrag_ctx *c, struct data_extent *e,
 
 static int write_direct_mapping(struct defrag_ctx *c, struct data_extent *e)
 {
-	struct inode *inode = c->inodes[e->inode_nr];
+	struct inode *inode = get_inode(c, e->inode_nr);
 	__u32 cur_block = e->start_block;
 	__u32 cur_logical = e->start_logical;
 	__u32 new_block;
@@ -325,9 +325,12 @@ static int write_direct_mapping(struct defrag_ctx *c, struct data_extent *e)
 	}
 
 out:
-	if (sync_inode)
+	if (sync_inode) {
+		if (cache_flush(c))
+			return -1;
 		/* Assumes the inode is completely within one page */
 		return msync(PAGE_START(inode->on_disk),getpagesize(), MS_SYNC);
+	}
 	return 0;
 }
 
@@ -438,7 +441,10 @@ out_update:
 	if (at_block) {
 		ret = write_block(c, header, at_block);
 	} else {
-		ret = msync(PAGE_START(header), getpagesize(), MS_SYNC);
+		ret = cache_flush(c);
+		if (!ret)
+			ret = msync(PAGE_START(header), getpagesize(),
+			            MS_SYNC);
 	}
 out_noupdate:
 	if (at_block)
@@ -474,7 +480,7 @@ out_error:
 int move_metadata_extent(struct defrag_ctx *c, struct data_extent *extent,
                          struct allocation *target)
 {
-	struct inode *inode = c->inodes[extent->inode_nr];
+	struct inode *inode = get_inode(c, extent->inode_nr);
 	blk64_t target_block, i;
 	int ret;
 	if (target->extent_count > 1) {
@@ -638,7 +644,8 @@ int write_extent_mapping(struct defrag_ctx *c, struct inode *inode)
 		num_blocks = num_indexes + num_extents / EXT_PER_BLOCK(&c->sb);
 		if (num_extents % EXT_PER_BLOCK(&c->sb))
 			num_blocks++;
-		new_metadata_blocks = get_blocks(c, num_blocks, inode_nr, 0);
+		new_metadata_blocks = get_blocks(c, num_blocks, inode_nr, 0,
+		                                 inode_goal(c, inode_nr));
 		if (new_metadata_blocks == NULL)
 			return -1;
 		ret = allocate(c, new_metadata_blocks);
@@ -662,7 +669,7 @@ int write_extent_mapping(struct defrag_ctx *c, struct inode *inode)
 		new_metadata_blocks->block_count = 0;
 		new_metadata_blocks->extent_count = 0;
 	}
-	fdatasync(c->fd);
+	cache_sync(c);
 	ret = update_inode_extents(inode, leaves, num_extents, depth);
 	if (ret < 0) {
 		if (new_metadata_blocks)
@@ -686,7 +693,7 @@ error_out:
 
 int write_extent_metadata(struct defrag_ctx *c, struct data_extent *e)
 {
-	struct inode *inode = c->inodes[e->inode_nr];
+	struct inode *inode = get_inode(c, e->inode_nr);
 
 	if (inode->metadata) { /* TODO: possibly redundant check, remove? */
 		return write_extent_mapping(c, inode);
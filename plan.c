@@ -0,0 +1,589 @@
+/*
+    Copyright 2009 Enno Ruijters
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of version 2 of the GNU General
+    Public License as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Move plans. A simulated run records every decision the algorithm makes
+ * on the in-memory model: the space reserved for an inode, the moves and
+ * the metadata rewrites. The plan is written to a file together with its
+ * cost, and can be carried out later without running the algorithm again.
+ *
+ * Executing a plan repeats the same free space operations in the same
+ * order on the same model, so the space allocated internally (for extent
+ * tree blocks, for example) is the same as in the simulated run. A plan is
+ * only executed on a disk whose block bitmaps have not changed since.
+ *
+ * Only the data copies are scheduled: the copies of consecutive inode moves
+ * are done in the order of their position on the disk before any of the
+ * inodes is switched over. Extent moves are not merged, as that would
+ * change the metadata writes and with them the internal allocations.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "e2defrag.h"
+#include "extree.h"
+
+#define PLAN_MAGIC "E2DFPLAN"
+#define PLAN_VERSION 2
+
+enum plan_step_type {
+	PLAN_RESERVE,		/* Space for an inode, extents follow */
+	PLAN_MOVE_INODE,	/* Moves an inode to its reserved space */
+	PLAN_MOVE_EXTENT,	/* Moves one extent of data or metadata */
+	PLAN_WRITE_METADATA,	/* Rewrites the metadata of an inode */
+	PLAN_MOVE_RUN,		/* Moves adjacent extents as one unit */
+	PLAN_CANCEL,		/* Gives back the space reserved for an inode */
+};
+
+struct plan_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_groups;
+	unsigned char uuid[16];
+	uint64_t blocks_count;
+	uint64_t bitmap_hash;
+	uint64_t nr_steps;
+	uint64_t nr_moves;
+	uint64_t blocks_to_copy;
+};
+
+/* PLAN_RESERVE steps are followed by count plan_extents */
+struct plan_step {
+	uint32_t type;
+	uint32_t inode_nr;
+	uint64_t from;
+	uint64_t to;
+	uint64_t count; /* blocks for PLAN_MOVE_EXTENT/RUN, else extents */
+};
+
+struct plan_extent {
+	uint64_t start_block;
+	uint64_t end_block;
+	uint64_t start_logical;
+	uint64_t uninit;
+};
+
+struct move_plan {
+	FILE *f;
+	struct plan_header h;
+	int error;
+};
+
+/* An inode's reserved space while executing a plan */
+struct pending_move {
+	ext2_ino_t inode_nr;
+	struct allocation *target;
+};
+
+struct inode_copy {
+	blk64_t source;
+	int step;
+};
+
+static uint64_t all_bitmaps_hash(struct defrag_ctx *c)
+{
+	uint64_t hash = 0;
+	int i;
+
+	for (i = 0; i < ext2_groups_on_disk(&c->sb); i++)
+		hash = hash * 0x100000001b3ULL ^ block_bitmap_hash(c, i);
+	return hash;
+}
+
+/* Number of blocks copy_data() has to copy to move from to target */
+static e2_blkcnt_t blocks_to_copy(const struct allocation *from,
+                                  const struct allocation *target)
+{
+	const struct data_extent *f = from->extents, *t = target->extents;
+	blk64_t cur_from, cur_to;
+	e2_blkcnt_t done = 0, ret = 0;
+
+	if (!from->extent_count || !target->extent_count)
+		return 0;
+	cur_from = f->start_block;
+	cur_to = t->start_block;
+	while (done < from->block_count && done < target->block_count) {
+		e2_blkcnt_t n;
+		if (cur_from > f->end_block)
+			cur_from = (++f)->start_block;
+		if (cur_to > t->end_block)
+			cur_to = (++t)->start_block;
+		n = f->end_block - cur_from + 1;
+		if (t->end_block - cur_to + 1 < n)
+			n = t->end_block - cur_to + 1;
+		if (!f->uninit && cur_from != cur_to)
+			ret += n;
+		done += n;
+		cur_from += n;
+		cur_to += n;
+	}
+	return ret;
+}
+
+static void write_step(struct defrag_ctx *c, const struct plan_step *s,
+                       const void *extra, size_t extra_size)
+{
+	struct move_plan *plan = c->plan;
+
+	if (fwrite(s, sizeof(*s), 1, plan->f) != 1
+	    || (extra_size && fwrite(extra, extra_size, 1, plan->f) != 1))
+		plan->error = errno ? errno : EIO;
+	plan->h.nr_steps++;
+}
+
+/* Starts recording the decisions of the algorithm to path */
+int plan_begin(struct defrag_ctx *c, const char *path)
+{
+	struct move_plan *plan = calloc(sizeof(*plan), 1);
+
+	if (!plan)
+		return -1;
+	plan->f = fopen(path, "w");
+	if (!plan->f) {
+		free(plan);
+		return -1;
+	}
+	memcpy(plan->h.magic, PLAN_MAGIC, sizeof(plan->h.magic));
+	plan->h.version = PLAN_VERSION;
+	plan->h.nr_groups = ext2_groups_on_disk(&c->sb);
+	memcpy(plan->h.uuid, c->sb.s_uuid, sizeof(plan->h.uuid));
+	plan->h.blocks_count = c->sb.s_blocks_count;
+	plan->h.bitmap_hash = all_bitmaps_hash(c);
+	/* The header is written again once the totals are known */
+	if (fwrite(&plan->h, sizeof(plan->h), 1, plan->f) != 1) {
+		fclose(plan->f);
+		free(plan);
+		return -1;
+	}
+	c->plan = plan;
+	return 0;
+}
+
+/* Stops recording and completes the plan file. Prints the cost of the
+ * plan unless recording failed.
+ */
+int plan_finish(struct defrag_ctx *c)
+{
+	struct move_plan *plan = c->plan;
+	int ret = 0;
+
+	c->plan = NULL;
+	if (!plan->error && (fseek(plan->f, 0, SEEK_SET)
+	                     || fwrite(&plan->h, sizeof(plan->h), 1, plan->f)
+	                        != 1))
+		plan->error = errno ? errno : EIO;
+	if (fclose(plan->f) && !plan->error)
+		plan->error = errno ? errno : EIO;
+	if (plan->error) {
+		errno = plan->error;
+		ret = -1;
+	} else {
+		printf("Plan: %llu moves, %llu blocks to copy\n",
+		       (unsigned long long)plan->h.nr_moves,
+		       (unsigned long long)plan->h.blocks_to_copy);
+	}
+	free(plan);
+	return ret;
+}
+
+void plan_reservation(struct defrag_ctx *c, ext2_ino_t inode_nr,
+                      const struct allocation *target)
+{
+	struct plan_step s = {
+		.type = PLAN_RESERVE,
+		.inode_nr = inode_nr,
+		.count = target->extent_count,
+	};
+	struct plan_extent *extents;
+	e2_blkcnt_t i;
+
+	if (!c->plan)
+		return;
+	extents = malloc((target->extent_count + 1) * sizeof(*extents));
+	if (!extents) {
+		c->plan->error = ENOMEM;
+		return;
+	}
+	for (i = 0; i < target->extent_count; i++) {
+		extents[i].start_block = target->extents[i].start_block;
+		extents[i].end_block = target->extents[i].end_block;
+		extents[i].start_logical = target->extents[i].start_logical;
+		extents[i].uninit = target->extents[i].uninit;
+	}
+	write_step(c, &s, extents, target->extent_count * sizeof(*extents));
+	free(extents);
+	c->plan->h.blocks_to_copy += blocks_to_copy(
+	        get_inode(c, inode_nr)->data, target);
+}
+
+void plan_inode_move(struct defrag_ctx *c, ext2_ino_t inode_nr)
+{
+	struct plan_step s = {
+		.type = PLAN_MOVE_INODE,
+		.inode_nr = inode_nr,
+	};
+
+	if (!c->plan)
+		return;
+	write_step(c, &s, NULL, 0);
+	c->plan->h.nr_moves++;
+}
+
+void plan_extent_move(struct defrag_ctx *c, ext2_ino_t inode_nr,
+                      blk64_t from, e2_blkcnt_t num_blocks, blk64_t to,
+                      int uninit)
+{
+	struct plan_step s = {
+		.type = PLAN_MOVE_EXTENT,
+		.inode_nr = inode_nr,
+		.from = from,
+		.to = to,
+		.count = num_blocks,
+	};
+
+	if (!c->plan)
+		return;
+	write_step(c, &s, NULL, 0);
+	c->plan->h.nr_moves++;
+	if (!uninit)
+		c->plan->h.blocks_to_copy += num_blocks;
+}
+
+/* Records that the space reserved for an inode was given back unused */
+void plan_cancel(struct defrag_ctx *c, ext2_ino_t inode_nr)
+{
+	struct plan_step s = {
+		.type = PLAN_CANCEL,
+		.inode_nr = inode_nr,
+	};
+
+	if (c->plan)
+		write_step(c, &s, NULL, 0);
+}
+
+/* Records a move by move_extent_run() of nr_extents extents, of which
+ * copied blocks hold data.
+ */
+void plan_run_move(struct defrag_ctx *c, ext2_ino_t inode_nr, blk64_t from,
+                   e2_blkcnt_t num_blocks, blk64_t to, int nr_extents,
+                   e2_blkcnt_t copied)
+{
+	struct plan_step s = {
+		.type = PLAN_MOVE_RUN,
+		.inode_nr = inode_nr,
+		.from = from,
+		.to = to,
+		.count = num_blocks,
+	};
+
+	if (!c->plan)
+		return;
+	write_step(c, &s, NULL, 0);
+	c->plan->h.nr_moves += nr_extents;
+	c->plan->h.blocks_to_copy += copied;
+}
+
+void plan_metadata_write(struct defrag_ctx *c, ext2_ino_t inode_nr)
+{
+	struct plan_step s = {
+		.type = PLAN_WRITE_METADATA,
+		.inode_nr = inode_nr,
+	};
+
+	if (c->plan)
+		write_step(c, &s, NULL, 0);
+}
+
+static char *read_plan_file(const char *path, size_t *size)
+{
+	FILE *f = fopen(path, "r");
+	char *buffer;
+	long length;
+
+	if (!f)
+		return NULL;
+	if (fseek(f, 0, SEEK_END) || (length = ftell(f)) < 0
+	    || fseek(f, 0, SEEK_SET)) {
+		fclose(f);
+		return NULL;
+	}
+	buffer = malloc(length ? length : 1);
+	if (buffer && fread(buffer, 1, length, f) != (size_t)length) {
+		free(buffer);
+		buffer = NULL;
+		errno = EIO;
+	}
+	fclose(f);
+	*size = length;
+	return buffer;
+}
+
+static int check_plan_header(struct defrag_ctx *c, const struct plan_header *h)
+{
+	if (memcmp(h->magic, PLAN_MAGIC, sizeof(h->magic))
+	    || h->version != PLAN_VERSION
+	    || memcmp(h->uuid, c->sb.s_uuid, sizeof(h->uuid))
+	    || h->nr_groups != ext2_groups_on_disk(&c->sb)
+	    || h->blocks_count != c->sb.s_blocks_count) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (h->bitmap_hash != all_bitmaps_hash(c)) {
+		printf("The disk has changed since the plan was made\n");
+		errno = ESTALE;
+		return -1;
+	}
+	return 0;
+}
+
+static struct allocation *plan_allocation(const struct plan_extent *extents,
+                                          uint64_t count, ext2_ino_t inode_nr)
+{
+	struct allocation *ret;
+	uint64_t i;
+
+	ret = malloc(sizeof(*ret) + count * sizeof(ret->extents[0]));
+	if (!ret)
+		return NULL;
+	ret->extent_count = count;
+	ret->block_count = 0;
+	for (i = 0; i < count; i++) {
+		ret->extents[i].start_block = extents[i].start_block;
+		ret->extents[i].end_block = extents[i].end_block;
+		ret->extents[i].start_logical = extents[i].start_logical;
+		ret->extents[i].uninit = extents[i].uninit;
+		ret->extents[i].inode_nr = inode_nr;
+		ret->block_count += extents[i].end_block
+		                    - extents[i].start_block + 1;
+	}
+	return ret;
+}
+
+/* Whether the blocks are exactly covered by whole extents */
+static int extents_cover(struct defrag_ctx *c, blk64_t from,
+                         e2_blkcnt_t num_blocks)
+{
+	blk64_t pos = from;
+
+	while (pos < from + num_blocks) {
+		struct data_extent *e = containing_data_extent(c, pos);
+		if (!e || e->start_block != pos)
+			return 0;
+		pos = e->end_block + 1;
+	}
+	return pos == from + num_blocks;
+}
+
+/* Carries out one step. Returns -1 with errno set if the step does not fit
+ * the current model.
+ */
+static int run_step(struct defrag_ctx *c, const struct plan_step *s,
+                    const struct plan_extent *extents,
+                    struct pending_move *pending, int *nr_pending)
+{
+	struct inode *inode = get_inode(c, s->inode_nr);
+	struct data_extent *extent;
+	int i;
+
+	errno = EINVAL;
+	if (!inode)
+		return -1;
+	switch (s->type) {
+	case PLAN_RESERVE:
+		if (*nr_pending == PLAN_BATCH)
+			return -1;
+		pending[*nr_pending].inode_nr = s->inode_nr;
+		pending[*nr_pending].target = plan_allocation(extents, s->count,
+		                                              s->inode_nr);
+		if (!pending[*nr_pending].target)
+			return -1;
+		if (pending[*nr_pending].target->block_count
+		    != inode->data->block_count
+		    || reserve_blocks(c, pending[*nr_pending].target) < 0) {
+			free(pending[*nr_pending].target);
+			return -1;
+		}
+		(*nr_pending)++;
+		return 0;
+	case PLAN_MOVE_INODE:
+		for (i = 0; i < *nr_pending; i++) {
+			struct allocation *target = pending[i].target;
+			if (pending[i].inode_nr != s->inode_nr)
+				continue;
+			pending[i] = pending[--(*nr_pending)];
+			commit_reservation(c, target);
+			return move_inode_data(c, s->inode_nr, target);
+		}
+		return -1;
+	case PLAN_CANCEL:
+		for (i = 0; i < *nr_pending; i++) {
+			struct allocation *target = pending[i].target;
+			if (pending[i].inode_nr != s->inode_nr)
+				continue;
+			pending[i] = pending[--(*nr_pending)];
+			cancel_reservation(c, target);
+			free(target);
+			return 0;
+		}
+		return -1;
+	case PLAN_MOVE_EXTENT:
+		extent = containing_data_extent(c, s->from);
+		if (!extent || extent->inode_nr != s->inode_nr
+		    || extent->start_block != s->from
+		    || extent->end_block - extent->start_block + 1 != s->count)
+			return -1;
+		return move_extent(c, extent, s->to);
+	case PLAN_MOVE_RUN:
+		extent = containing_data_extent(c, s->from);
+		if (!extent || extent->inode_nr != s->inode_nr || !s->count
+		    || !extents_cover(c, s->from, s->count))
+			return -1;
+		return move_extent_run(c, s->from, s->count, s->to);
+	case PLAN_WRITE_METADATA:
+		return write_inode_metadata(c, inode);
+	}
+	return -1;
+}
+
+static int compare_inode_copies(const void *a, const void *b)
+{
+	const struct inode_copy *x = a, *y = b;
+
+	if (x->source != y->source)
+		return x->source < y->source ? -1 : 1;
+	return x->step - y->step;
+}
+
+/* Carries out count consecutive PLAN_MOVE_INODE steps. Their targets were
+ * all reserved while the data of the others was still in place, so no copy
+ * overwrites the source of another one. The data is copied in the order of
+ * its position on the disk, then the inodes are switched over in recorded
+ * order.
+ */
+static int run_inode_moves(struct defrag_ctx *c, const struct plan_step *s,
+                           int count, struct pending_move *pending,
+                           int *nr_pending)
+{
+	struct pending_move moves[PLAN_BATCH];
+	struct inode_copy order[PLAN_BATCH];
+	int i, j, ret;
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < *nr_pending; j++)
+			if (pending[j].inode_nr == s[i].inode_nr)
+				break;
+		if (j == *nr_pending) {
+			/* Left for run_plan() to give back */
+			while (i--)
+				pending[(*nr_pending)++] = moves[i];
+			errno = EINVAL;
+			return -1;
+		}
+		moves[i] = pending[j];
+		pending[j] = pending[--(*nr_pending)];
+		order[i].source = get_inode(c, s[i].inode_nr)->data
+		                  ->extents[0].start_block;
+		order[i].step = i;
+	}
+	qsort(order, count, sizeof(*order), compare_inode_copies);
+	for (i = 0; i < count; i++)
+		commit_reservation(c, moves[i].target);
+	ret = copy_queue_begin(c);
+	for (i = 0; i < count && !ret; i++) {
+		j = order[i].step;
+		ret = copy_data(c, get_inode(c, s[j].inode_nr)->data,
+		                &moves[j].target);
+	}
+	if (copy_queue_end(c) < 0)
+		ret = -1;
+	for (i = 0; i < count; i++) {
+		if (ret)
+			deallocate_blocks(c, moves[i].target);
+		else
+			ret = switch_inode_data(c, s[i].inode_nr,
+			                        moves[i].target);
+	}
+	return ret;
+}
+
+/* Carries out the plan in path. Space reserved by the plan but not used
+ * because of an error is given back.
+ */
+int run_plan(struct defrag_ctx *c, const char *path)
+{
+	struct pending_move pending[PLAN_BATCH];
+	const struct plan_header *h;
+	size_t size, offset;
+	char *buffer;
+	uint64_t i;
+	int nr_pending = 0, ret = 0, n;
+
+	buffer = read_plan_file(path, &size);
+	if (!buffer)
+		return -1;
+	h = (void *)buffer;
+	if (size < sizeof(*h) || check_plan_header(c, h)) {
+		if (size < sizeof(*h))
+			errno = EINVAL;
+		free(buffer);
+		return -1;
+	}
+	printf("Executing plan: %llu moves, %llu blocks to copy\n",
+	       (unsigned long long)h->nr_moves,
+	       (unsigned long long)h->blocks_to_copy);
+	offset = sizeof(*h);
+	for (i = 0; i < h->nr_steps && ret >= 0; i++) {
+		const struct plan_step *s = (void *)(buffer + offset);
+		const struct plan_extent *extents;
+
+		ret = -1;
+		errno = EINVAL;
+		if (offset + sizeof(*s) > size)
+			break;
+		offset += sizeof(*s);
+		extents = (void *)(buffer + offset);
+		if (s->type == PLAN_RESERVE) {
+			if (!s->count || s->count > (size - offset)
+			                            / sizeof(*extents))
+				break;
+			offset += s->count * sizeof(*extents);
+		}
+		if (s->type == PLAN_MOVE_INODE) {
+			n = 1;
+			while (n < PLAN_BATCH && i + n < h->nr_steps
+			       && offset + n * sizeof(*s) <= size
+			       && s[n].type == PLAN_MOVE_INODE)
+				n++;
+			offset += (n - 1) * sizeof(*s);
+			ret = run_inode_moves(c, s, n, pending, &nr_pending);
+		} else {
+			n = 1;
+			ret = run_step(c, s, extents, pending, &nr_pending);
+		}
+		if (ret < 0)
+			printf("Plan step %llu failed: %s\n",
+			       (unsigned long long)i, strerror(errno));
+		i += n - 1;
+	}
+	while (nr_pending--) {
+		cancel_reservation(c, pending[nr_pending].target);
+		free(pending[nr_pending].target);
+	}
+	free(buffer);
+	return ret < 0 ? -1 : 0;
+}
@@ -382,3 +382,111 @@ void rb_replace_node(struct rb_node *victim, struct rb_node *new,
 	/* Copy the pointers/colour from the victim to the replacement */
 	*new = *victim;
 }
+
+static void rb_augment_path(struct rb_node *node, rb_augment_f func, void *data)
+{
+	struct rb_node *parent;
+
+up:
+	func(node, data);
+	parent = rb_parent(node);
+	if (!parent)
+		return;
+
+	if (node == parent->rb_left && parent->rb_right)
+		func(parent->rb_right, data);
+	else if (parent->rb_left)
+		func(parent->rb_left, data);
+
+	node = parent;
+	goto up;
+}
+
+/*
+ * after inserting @node into the tree, update the tree to account for
+ * both the new entry and any damage done by rebalance
+ */
+void rb_augment_insert(struct rb_node *node, rb_augment_f func, void *data)
+{
+	if (node->rb_left)
+		node = node->rb_left;
+	else if (node->rb_right)
+		node = node->rb_right;
+
+	rb_augment_path(node, func, data);
+}
+
+/*
+ * before removing the node, find the deepest node on the rebalance path
+ * that will still be there after @node gets removed
+ */
+struct rb_node *rb_augment_erase_begin(struct rb_node *node)
+{
+	struct rb_node *deepest;
+
+	if (!node->rb_right && !node->rb_left)
+		deepest = rb_parent(node);
+	else if (!node->rb_right)
+		deepest = node->rb_left;
+	else if (!node->rb_left)
+		deepest = node->rb_right;
+	else {
+		deepest = rb_next(node);
+		if (deepest->rb_right)
+			deepest = deepest->rb_right;
+		else if (rb_parent(deepest) != node)
+			deepest = rb_parent(deepest);
+	}
+
+	return deepest;
+}
+
+/*
+ * after removal, update the tree to account for the removed entry
+ * and any rebalance damage.
+ */
+void rb_augment_erase_end(struct rb_node *node, rb_augment_f func, void *data)
+{
+	if (node)
+		rb_augment_path(node, func, data);
+}
+
+static struct rb_node *build_sorted(struct rb_node **nodes, size_t count,
+				    struct rb_node *parent, int depth,
+				    int red_depth, rb_augment_f func,
+				    void *data)
+{
+	size_t mid = count / 2;
+	struct rb_node *node;
+
+	if (!count)
+		return NULL;
+	node = nodes[mid];
+	node->rb_parent_color = (unsigned long)parent;
+	rb_set_color(node, depth == red_depth ? RB_RED : RB_BLACK);
+	node->rb_left = build_sorted(nodes, mid, node, depth + 1,
+				     red_depth, func, data);
+	node->rb_right = build_sorted(nodes + mid + 1, count - mid - 1, node,
+				      depth + 1, red_depth, func, data);
+	if (func)
+		func(node, data);
+	return node;
+}
+
+/*
+ * Builds a tree from nodes already in sorted order in linear time, instead
+ * of inserting and rebalancing them one by one. Splitting at the middle
+ * fills every level but the last one, which is colored red. If func is
+ * given it is called on every node after its children, as for the augment
+ * functions above.
+ */
+void rb_build_sorted(struct rb_root *root, struct rb_node **nodes,
+		     size_t count, rb_augment_f func, void *data)
+{
+	int full_levels = 0;
+
+	while (((size_t)2 << full_levels) - 1 <= count)
+		full_levels++;
+	root->rb_node = build_sorted(nodes, count, NULL, 0, full_levels,
+				     func, data);
+}
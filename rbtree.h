@@ -150,6 +150,20 @@ extern struct rb_node *rb_last(const struct rb_root *);
 extern void rb_replace_node(struct rb_node *victim, struct rb_node *new, 
 			    struct rb_root *root);
 
+/* Helpers for trees keeping per-subtree data in the nodes. func recomputes
+ * the data of one node from its children. */
+typedef void (*rb_augment_f)(struct rb_node *node, void *data);
+
+extern void rb_augment_insert(struct rb_node *node,
+			      rb_augment_f func, void *data);
+extern struct rb_node *rb_augment_erase_begin(struct rb_node *node);
+extern void rb_augment_erase_end(struct rb_node *node,
+				 rb_augment_f func, void *data);
+
+/* Bulk construction from nodes in ascending order; the tree must be empty */
+extern void rb_build_sorted(struct rb_root *root, struct rb_node **nodes,
+			    size_t count, rb_augment_f func, void *data);
+
 static inline void rb_link_node(struct rb_node * node, struct rb_node * parent,
 				struct rb_node ** rb_link)
 {
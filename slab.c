@@ -0,0 +1,76 @@
+/*
+    Copyright 2009 Enno Ruijters
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of version 2 of the GNU General
+    Public License as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <malloc.h>
+#define obstack_chunk_alloc malloc
+#define obstack_chunk_free free
+#include "slab.h"
+
+/* Large chunks, so that the per-chunk overhead of the obstack is negligible */
+#define SLAB_CHUNK_SIZE (64 * 1024)
+
+void slab_init(struct slab *slab, size_t object_size)
+{
+	slab_init_aligned(slab, object_size, 0);
+}
+
+/* Like slab_init(), but every object starts at a multiple of align bytes.
+ * An align of 0 uses the default alignment of the obstack.
+ */
+void slab_init_aligned(struct slab *slab, size_t object_size, size_t align)
+{
+	/* Free objects hold the free list pointer */
+	if (object_size < sizeof(void *))
+		object_size = sizeof(void *);
+	slab->object_size = object_size;
+	slab->free_list = NULL;
+	obstack_specify_allocation(&slab->pool, SLAB_CHUNK_SIZE, align,
+	                           malloc, free);
+	pthread_mutex_init(&slab->lock, NULL);
+}
+
+void *slab_alloc(struct slab *slab)
+{
+	void *ret;
+
+	pthread_mutex_lock(&slab->lock);
+	if (slab->free_list) {
+		ret = slab->free_list;
+		slab->free_list = *(void **)ret;
+	} else {
+		ret = obstack_alloc(&slab->pool, slab->object_size);
+	}
+	pthread_mutex_unlock(&slab->lock);
+	return ret;
+}
+
+void slab_free(struct slab *slab, void *object)
+{
+	if (!object)
+		return;
+	pthread_mutex_lock(&slab->lock);
+	*(void **)object = slab->free_list;
+	slab->free_list = object;
+	pthread_mutex_unlock(&slab->lock);
+}
+
+void slab_destroy(struct slab *slab)
+{
+	obstack_free(&slab->pool, NULL);
+	slab->free_list = NULL;
+	pthread_mutex_destroy(&slab->lock);
+}
@@ -0,0 +1,42 @@
+/*
+    Copyright 2009 Enno Ruijters
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of version 2 of the GNU General
+    Public License as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <obstack.h>
+
+/* Allocator for many objects of one fixed size. Objects are carved out of
+ * an obstack and recycled through a free list; the memory is only returned
+ * to the system by slab_destroy(), which releases all objects at once.
+ */
+struct slab {
+	struct obstack pool;
+	void *free_list;
+	size_t object_size;
+	pthread_mutex_t lock;
+};
+
+void slab_init(struct slab *slab, size_t object_size);
+void slab_init_aligned(struct slab *slab, size_t object_size, size_t align);
+void *slab_alloc(struct slab *slab);
+void slab_free(struct slab *slab, void *object);
+void slab_destroy(struct slab *slab);
+
+#endif
@@ -0,0 +1,601 @@
+/*
+    Copyright 2009 Enno Ruijters
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of version 2 of the GNU General
+    Public License as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Snapshot of the parsed filesystem model, used to skip re-reading the
+ * block maps of inodes that did not change since the previous run.
+ *
+ * Every saved inode carries a key made of the on-disk fields that change
+ * whenever its block map changes (ctime, mtime, i_blocks, flags, generation
+ * and a hash of i_block). Inodes big enough to hold the nanoseconds of
+ * ctime and mtime include them, so a change within the same second as the
+ * snapshot is noticed. An inode is only restored if its key still
+ * matches; all other inodes are parsed as usual. The free extents of a
+ * group are restored if its block bitmap is unchanged, and parsed from the
+ * bitmap otherwise.
+ *
+ * The inode tables are still read in every group: a changed block map shows
+ * in the bitmaps of the groups holding the blocks, not in the group of the
+ * inode, so the group descriptors cannot tell which inode tables to skip.
+ *
+ * The file is in host byte order; it is a cache, not an exchange format.
+ */
+
+#define _LARGEFILE64_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <obstack.h>
+#define obstack_chunk_alloc malloc
+#define obstack_chunk_free free
+#include <sys/stat.h>
+#include "e2defrag.h"
+#include "extree.h"
+
+#define STATE_MAGIC "E2DFSTAT"
+#define STATE_VERSION 3
+#define NO_METADATA (~(uint64_t)0)
+
+struct state_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_groups;
+	unsigned char uuid[16];
+	uint64_t blocks_count;
+	uint32_t inodes_count;
+	uint32_t block_size;
+	uint64_t nr_inodes;
+	uint64_t nr_free_extents;
+	uint64_t min_free_extent; /* smaller free extents are not saved */
+};
+
+struct inode_key {
+	uint32_t ctime;
+	uint32_t mtime;
+	uint32_t ctime_extra;
+	uint32_t mtime_extra;
+	uint32_t blocks;
+	uint32_t flags;
+	uint32_t generation;
+	uint32_t pad;
+	uint64_t block_hash;
+};
+
+/* Followed by data_count extents, then metadata_count extents (unless it is
+ * NO_METADATA), then num_sparse sparse extents.
+ */
+struct saved_inode {
+	uint32_t inode_nr;
+	uint32_t num_sparse;
+	struct inode_key key;
+	uint64_t data_count;
+	uint64_t metadata_count;
+};
+
+struct saved_extent {
+	uint64_t start_block;
+	uint64_t end_block;
+	uint64_t start_logical;
+	uint64_t uninit;
+};
+
+struct saved_free_extent {
+	uint64_t start_block;
+	uint64_t end_block;
+};
+
+struct saved_state {
+	char *buffer;
+	const struct state_header *header;
+	const uint64_t *bitmap_hashes;
+	const struct saved_inode **inodes;
+	const struct saved_free_extent *free_extents;
+	uint64_t next_free; /* first saved free extent not restored yet */
+	unsigned long reused;
+	unsigned long groups_reused;
+};
+
+/* 64-bit FNV-1a */
+static uint64_t hash_bytes(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static void make_inode_key(struct defrag_ctx *c, struct inode_key *key,
+                           const struct ext2_inode *inode)
+{
+	const struct ext2_inode_large *large = (const void *)inode;
+
+	key->ctime = inode->i_ctime;
+	key->mtime = inode->i_mtime;
+	key->ctime_extra = 0;
+	key->mtime_extra = 0;
+	if (EXT2_INODE_SIZE(&c->sb) > EXT2_GOOD_OLD_INODE_SIZE
+	    && large->i_extra_isize >= offsetof(struct ext2_inode_large,
+	                                        i_atime_extra)
+	                               - EXT2_GOOD_OLD_INODE_SIZE) {
+		key->ctime_extra = large->i_ctime_extra;
+		key->mtime_extra = large->i_mtime_extra;
+	}
+	key->blocks = inode->i_blocks;
+	key->flags = inode->i_flags;
+	key->generation = inode->i_generation;
+	key->pad = 0;
+	key->block_hash = hash_bytes(inode->i_block, sizeof(inode->i_block));
+}
+
+uint64_t block_bitmap_hash(struct defrag_ctx *c, int group_nr)
+{
+	return hash_bytes(c->bg_maps[group_nr].bitmap,
+	                  c->sb.s_blocks_per_group / CHAR_BIT);
+}
+
+static size_t saved_inode_size(const struct saved_inode *s)
+{
+	size_t ret = sizeof(*s);
+	ret += s->data_count * sizeof(struct saved_extent);
+	if (s->metadata_count != NO_METADATA)
+		ret += s->metadata_count * sizeof(struct saved_extent);
+	ret += s->num_sparse * sizeof(struct sparse_extent);
+	return ret;
+}
+
+static int check_header(struct defrag_ctx *c, const struct state_header *h)
+{
+	if (memcmp(h->magic, STATE_MAGIC, sizeof(h->magic))
+	    || h->version != STATE_VERSION
+	    || memcmp(h->uuid, c->sb.s_uuid, sizeof(h->uuid))
+	    || h->nr_groups != ext2_groups_on_disk(&c->sb)
+	    || h->blocks_count != c->sb.s_blocks_count
+	    || h->inodes_count != c->sb.s_inodes_count
+	    || h->block_size != EXT2_BLOCK_SIZE(&c->sb))
+		return -1;
+	return 0;
+}
+
+static int read_state_file(struct saved_state *state, const char *path,
+                           size_t *size)
+{
+	struct stat64 st;
+	ssize_t ret;
+	size_t done = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat64(fd, &st) < 0)
+		goto out_close;
+	*size = st.st_size;
+	state->buffer = malloc(*size + 1);
+	if (!state->buffer)
+		goto out_close;
+	while (done < *size) {
+		ret = read(fd, state->buffer + done, *size - done);
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = EINVAL;
+			goto out_free;
+		}
+		done += ret;
+	}
+	close(fd);
+	return 0;
+
+out_free:
+	free(state->buffer);
+out_close:
+	close(fd);
+	return -1;
+}
+
+/* Returns whether all count extents lie on the disk */
+static int extents_valid(struct defrag_ctx *c, const struct saved_extent *e,
+                         uint64_t count)
+{
+	uint64_t i;
+
+	for (i = 0; i < count; i++) {
+		if (e[i].start_block > e[i].end_block
+		    || e[i].end_block >= c->sb.s_blocks_count)
+			return 0;
+	}
+	return 1;
+}
+
+/* Loads the snapshot at path. Returns 0 on success, or -1 with errno set if
+ * there is no usable snapshot; in that case everything is parsed as usual.
+ */
+int load_state(struct defrag_ctx *c, const char *path)
+{
+	struct saved_state *state;
+	size_t size, offset;
+	uint64_t i;
+
+	state = calloc(sizeof(*state), 1);
+	if (!state)
+		return -1;
+	if (read_state_file(state, path, &size) < 0) {
+		free(state);
+		return -1;
+	}
+	errno = EINVAL;
+	state->header = (void *)state->buffer;
+	if (size < sizeof(*state->header) || check_header(c, state->header))
+		goto out_invalid;
+	offset = sizeof(*state->header);
+	state->bitmap_hashes = (void *)(state->buffer + offset);
+	offset += state->header->nr_groups * sizeof(uint64_t);
+	if (offset > size
+	    || state->header->nr_inodes > c->sb.s_inodes_count)
+		goto out_invalid;
+	state->inodes = malloc((state->header->nr_inodes + 1)
+	                       * sizeof(*state->inodes));
+	if (!state->inodes)
+		goto out_invalid;
+	for (i = 0; i < state->header->nr_inodes; i++) {
+		const struct saved_inode *s = (void *)(state->buffer + offset);
+		if (offset + sizeof(*s) > size)
+			goto out_invalid;
+		if (i && s->inode_nr <= state->inodes[i - 1]->inode_nr)
+			goto out_invalid;
+		if (s->data_count > c->sb.s_blocks_count
+		    || (s->metadata_count != NO_METADATA
+		        && s->metadata_count > c->sb.s_blocks_count)
+		    || s->num_sparse > c->sb.s_blocks_count)
+			goto out_invalid;
+		if (offset + saved_inode_size(s) > size)
+			goto out_invalid;
+		/* The extents drive real block moves, so none may be off the
+		   disk, however stale the snapshot is */
+		if (!extents_valid(c, (const void *)(s + 1), s->data_count)
+		    || (s->metadata_count != NO_METADATA
+		        && !extents_valid(c, (const struct saved_extent *)(s + 1)
+		                             + s->data_count,
+		                          s->metadata_count)))
+			goto out_invalid;
+		state->inodes[i] = s;
+		offset += saved_inode_size(s);
+	}
+	state->free_extents = (void *)(state->buffer + offset);
+	if (state->header->nr_free_extents > c->sb.s_blocks_count)
+		goto out_invalid;
+	offset += state->header->nr_free_extents
+	          * sizeof(struct saved_free_extent);
+	if (offset != size)
+		goto out_invalid;
+	for (i = 0; i < state->header->nr_free_extents; i++) {
+		const struct saved_free_extent *f = &state->free_extents[i];
+		if (f->start_block > f->end_block
+		    || f->end_block >= c->sb.s_blocks_count
+		    || (i && f->start_block <= f[-1].end_block))
+			goto out_invalid;
+	}
+	c->state = state;
+	return 0;
+
+out_invalid:
+	free(state->inodes);
+	free(state->buffer);
+	free(state);
+	return -1;
+}
+
+static const struct saved_inode *find_saved_inode(struct saved_state *state,
+                                                  ext2_ino_t inode_nr)
+{
+	uint64_t low = 0, high = state->header->nr_inodes;
+	while (low < high) {
+		uint64_t mid = low + (high - low) / 2;
+		if (state->inodes[mid]->inode_nr < inode_nr)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (low < state->header->nr_inodes
+	    && state->inodes[low]->inode_nr == inode_nr)
+		return state->inodes[low];
+	return NULL;
+}
+
+static struct allocation *restore_allocation(const struct saved_extent *e,
+                                             uint64_t count,
+                                             ext2_ino_t inode_nr)
+{
+	struct allocation *ret;
+	uint64_t i;
+
+	ret = malloc(sizeof(struct allocation)
+	             + count * sizeof(struct data_extent));
+	if (!ret)
+		return NULL;
+	ret->block_count = 0;
+	ret->extent_count = count;
+	for (i = 0; i < count; i++) {
+		struct data_extent *d = &ret->extents[i];
+		memset(d, 0, sizeof(*d));
+		d->start_block = e[i].start_block;
+		d->end_block = e[i].end_block;
+		d->start_logical = e[i].start_logical;
+		d->uninit = e[i].uninit;
+		d->inode_nr = inode_nr;
+		ret->block_count += d->end_block - d->start_block + 1;
+	}
+	return ret;
+}
+
+/* Rebuilds the in-memory inode from the snapshot if the on-disk inode did
+ * not change since it was saved. Returns NULL if the inode must be parsed.
+ */
+struct inode *restore_inode(struct defrag_ctx *c, ext2_ino_t inode_nr,
+                            struct ext2_inode *on_disk)
+{
+	const struct saved_inode *s;
+	const struct saved_extent *extents;
+	struct inode_key key;
+	struct inode *ret;
+
+	if (!c->state)
+		return NULL;
+	s = find_saved_inode(c->state, inode_nr);
+	if (!s)
+		return NULL;
+	make_inode_key(c, &key, on_disk);
+	if (memcmp(&key, &s->key, sizeof(key)))
+		return NULL;
+
+	ret = slab_alloc(&c->inode_slab);
+	if (!ret)
+		return NULL;
+	extents = (const struct saved_extent *)(s + 1);
+	ret->on_disk = (union on_disk_block *)on_disk->i_block;
+	ret->metadata = NULL;
+	ret->sparse = NULL;
+	ret->num_sparse = s->num_sparse;
+	ret->data = restore_allocation(extents, s->data_count, inode_nr);
+	if (!ret->data)
+		goto out_free;
+	extents += s->data_count;
+	if (s->metadata_count != NO_METADATA) {
+		ret->metadata = restore_allocation(extents, s->metadata_count,
+		                                   inode_nr);
+		if (!ret->metadata)
+			goto out_free;
+		extents += s->metadata_count;
+	}
+	if (s->num_sparse) {
+		size_t size = s->num_sparse * sizeof(struct sparse_extent);
+		ret->sparse = malloc(size);
+		if (!ret->sparse)
+			goto out_free;
+		memcpy(ret->sparse, extents, size);
+	}
+	__sync_fetch_and_add(&c->state->reused, 1);
+	return ret;
+
+out_free:
+	free(ret->data);
+	free(ret->metadata);
+	slab_free(&c->inode_slab, ret);
+	return NULL;
+}
+
+static int block_in_use(const unsigned char *bitmap, unsigned long bit)
+{
+	return bitmap[bit / CHAR_BIT] & (1 << (bit % CHAR_BIT));
+}
+
+/* Appends the free extents of a group to list like collect_free_extents()
+ * does, if the block bitmap of the group did not change since the snapshot
+ * was taken. Must be called for the groups in ascending order. Returns 0 if
+ * the free space was restored, 1 if it has to be parsed from the bitmap and
+ * -1 on error.
+ *
+ * The free runs at the start and the end of the group may continue into
+ * neighbouring groups that did change, so they are taken from the bitmap.
+ * The runs in between only depend on this group, and are exactly the saved
+ * free extents that start there.
+ */
+int restore_group_free_space(struct defrag_ctx *c, int group_nr,
+                             struct obstack *list, struct free_extent **last)
+{
+	struct saved_state *state = c->state;
+	const unsigned char *bitmap = c->bg_maps[group_nr].bitmap;
+	blk64_t first_block = group_nr * c->sb.s_blocks_per_group;
+	unsigned long head, tail, nr_bits;
+	uint64_t i;
+
+	first_block += c->sb.s_first_data_block;
+	if (!state || state->header->min_free_extent
+	              != global_settings.min_free_extent
+	    || state->bitmap_hashes[group_nr] != block_bitmap_hash(c, group_nr))
+		return 1;
+	nr_bits = c->sb.s_blocks_per_group;
+	if (first_block + nr_bits > c->sb.s_blocks_count)
+		nr_bits = c->sb.s_blocks_count - first_block;
+
+	head = find_next_set_bit(bitmap, nr_bits, 0);
+	if (head && append_free_run(c, list, last, first_block,
+	                            first_block + head - 1) < 0)
+		return -1;
+	if (head == nr_bits)
+		goto out;
+	tail = nr_bits;
+	while (!block_in_use(bitmap, tail - 1))
+		tail--;
+	for (i = state->next_free; i < state->header->nr_free_extents; i++) {
+		const struct saved_free_extent *f = &state->free_extents[i];
+		if (f->start_block >= first_block + tail)
+			break;
+		if (f->start_block < first_block + head)
+			continue;
+		if (append_free_run(c, list, last, f->start_block,
+		                    f->end_block) < 0)
+			return -1;
+	}
+	state->next_free = i;
+	if (tail < nr_bits && append_free_run(c, list, last, first_block + tail,
+	                                      first_block + nr_bits - 1) < 0)
+		return -1;
+out:
+	state->groups_reused++;
+	return 0;
+}
+
+/* Releases the loaded snapshot once the model has been built */
+void drop_state(struct defrag_ctx *c)
+{
+	if (!c->state)
+		return;
+	printf("Reused %lu of %u inodes and the free space of %lu of %lu "
+	       "groups from the state file\n", c->state->reused,
+	       c->nr_live_inodes, c->state->groups_reused,
+	       (unsigned long)ext2_groups_on_disk(&c->sb));
+	free(c->state->inodes);
+	free(c->state->buffer);
+	free(c->state);
+	c->state = NULL;
+}
+
+static int save_allocation(FILE *f, const struct allocation *alloc)
+{
+	e2_blkcnt_t i;
+	for (i = 0; i < alloc->extent_count; i++) {
+		struct saved_extent e = {
+			.start_block = alloc->extents[i].start_block,
+			.end_block = alloc->extents[i].end_block,
+			.start_logical = alloc->extents[i].start_logical,
+			.uninit = alloc->extents[i].uninit,
+		};
+		if (fwrite(&e, sizeof(e), 1, f) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+static int save_inode(struct defrag_ctx *c, FILE *f, ext2_ino_t inode_nr,
+                      const struct inode *inode)
+{
+	const struct ext2_inode *on_disk;
+	struct saved_inode s;
+
+	on_disk = (const void *)((const char *)inode->on_disk
+	                         - offsetof(struct ext2_inode, i_block));
+	s.inode_nr = inode_nr;
+	s.num_sparse = inode->num_sparse;
+	make_inode_key(c, &s.key, on_disk);
+	s.data_count = inode->data->extent_count;
+	if (inode->metadata)
+		s.metadata_count = inode->metadata->extent_count;
+	else
+		s.metadata_count = NO_METADATA;
+	if (fwrite(&s, sizeof(s), 1, f) != 1)
+		return -1;
+	if (save_allocation(f, inode->data))
+		return -1;
+	if (inode->metadata && save_allocation(f, inode->metadata))
+		return -1;
+	if (inode->num_sparse && fwrite(inode->sparse,
+	                                sizeof(struct sparse_extent),
+	                                inode->num_sparse, f)
+	                         != inode->num_sparse)
+		return -1;
+	return 0;
+}
+
+/* Writes the current model to path. The snapshot is written to a temporary
+ * file first, so an interrupted save never leaves a truncated snapshot.
+ */
+int save_state(struct defrag_ctx *c, const char *path)
+{
+	struct state_header h;
+	struct rb_node *n;
+	char tmp_path[PATH_MAX];
+	ext2_ino_t i;
+	FILE *f;
+
+	if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path)
+	    >= sizeof(tmp_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	f = fopen(tmp_path, "w");
+	if (!f)
+		return -1;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, STATE_MAGIC, sizeof(h.magic));
+	h.version = STATE_VERSION;
+	h.nr_groups = ext2_groups_on_disk(&c->sb);
+	memcpy(h.uuid, c->sb.s_uuid, sizeof(h.uuid));
+	h.blocks_count = c->sb.s_blocks_count;
+	h.inodes_count = c->sb.s_inodes_count;
+	h.block_size = EXT2_BLOCK_SIZE(&c->sb);
+	h.nr_inodes = c->nr_live_inodes;
+	h.min_free_extent = global_settings.min_free_extent;
+	for (n = rb_first(&c->free_tree_by_block); n; n = rb_next(n))
+		h.nr_free_extents++;
+	if (fwrite(&h, sizeof(h), 1, f) != 1)
+		goto out_error;
+
+	for (i = 0; i < h.nr_groups; i++) {
+		uint64_t hash = block_bitmap_hash(c, i);
+		if (fwrite(&hash, sizeof(hash), 1, f) != 1)
+			goto out_error;
+	}
+	for (i = 0; i < c->nr_live_inodes; i++) {
+		ext2_ino_t inode_nr = c->live_inodes[i];
+		if (save_inode(c, f, inode_nr, get_inode(c, inode_nr)))
+			goto out_error;
+	}
+	for (n = rb_first(&c->free_tree_by_block); n; n = rb_next(n)) {
+		struct free_extent *e;
+		struct saved_free_extent s;
+		e = rb_entry(n, struct free_extent, block_rb);
+		s.start_block = e->start_block;
+		s.end_block = e->end_block;
+		if (fwrite(&s, sizeof(s), 1, f) != 1)
+			goto out_error;
+	}
+	/* The snapshot must be complete on disk before it replaces the old
+	   one, or a crash could leave a truncated snapshot behind */
+	if (fflush(f) || fsync(fileno(f))) {
+		fclose(f);
+		unlink(tmp_path);
+		return -1;
+	}
+	if (fclose(f)) {
+		unlink(tmp_path);
+		return -1;
+	}
+	return rename(tmp_path, path);
+
+out_error:
+	fclose(f);
+	unlink(tmp_path);
+	return -1;
+}
@@ -0,0 +1,56 @@
+# Copyright 2009 Enno Ruijters
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of version 2 of the GNU General
+# Public License as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#!/bin/sh
+
+# Tests if several fragmented files are correctly defragmented on a nearly
+# full ext4 filesystem with several data copies in flight. The 64-block
+# extents of two of the files are copied in one batch; the last one only
+# fits after runs of small files are moved out of its way.
+
+. ./test-lib.sh
+
+test_begin "t1370-fragmented-files-io-depth"
+
+load_image fragmented-files
+
+FILES="s f1 f2 f3 t1 t3"
+for i in 1 2 3 4 5 6 7 8 9; do
+	FILES="$FILES k$i j$i"
+done
+
+infra_cmd "mv fragmented-files.img disk.img"
+for f in $FILES; do
+	infra_cmd "echo \"dump $f before-$f\nquit\n\" | debugfs disk.img \
+	           > /dev/null 2>/dev/null"
+done
+
+test_and_stop_on_error "defragmenting ext4 disk with 4 copies in flight" \
+                       "e2defrag -q 4 disk.img > /dev/null"
+
+test_and_continue "resulting image should not have file system errors" \
+                  "e2fsck -f -y disk.img 2>/dev/null > fsckout"
+
+test_and_continue "resulting image should not be fragmented" \
+                  "grep \"0.0% non-contiguous\" fsckout > /dev/null"
+
+test_and_continue "files in image should be unchanged" \
+                  "for f in $FILES; do \
+                       echo \"dump \$f after-\$f\nquit\n\" \
+                       | debugfs disk.img > /dev/null 2>/dev/null \
+                       && cmp before-\$f after-\$f || exit 1; \
+                   done"
+
+test_end
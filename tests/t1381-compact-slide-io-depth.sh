@@ -0,0 +1,58 @@
+# Copyright 2009 Enno Ruijters
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of version 2 of the GNU General
+# Public License as published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#!/bin/sh
+
+# Tests if --compact keeps data intact when several copies are in flight.
+# The files are slid over their own blocks in 1 MiB chunks, so a chunk may
+# only be copied once no chunk it overlaps is still being copied.
+
+. ./test-lib.sh
+
+test_begin "t1381-compact-slide-io-depth"
+
+load_image compact-slide
+
+infra_cmd "mv compact-slide.img disk.img"
+for f in base b1 b2 b3 b4 d; do
+	infra_cmd "echo \"dump $f before-$f\nquit\n\" | debugfs disk.img \
+	           > /dev/null 2>/dev/null"
+done
+
+test_and_stop_on_error "compacting ext4 disk with 4 copies in flight" \
+                       "e2defrag --compact -q 4 disk.img > /dev/null"
+
+test_and_continue "resulting image should not have file system errors" \
+                  "e2fsck -f -y disk.img 2>/dev/null > fsckout"
+
+test_and_continue "files in image should be unchanged" \
+                  "for f in base b1 b2 b3 b4 d; do \
+                       echo \"dump \$f after-\$f\nquit\n\" \
+                       | debugfs disk.img > /dev/null 2>/dev/null \
+                       && cmp before-\$f after-\$f || exit 1; \
+                   done"
+
+test_and_continue "files should be packed behind each other" \
+                  "echo \"stat b1\nstat b2\nstat b3\nstat b4\nstat d\nquit\n\" \
+                   | debugfs disk.img 2>/dev/null | grep '^(0-' > layout \
+                   && printf '%s\n' '(0-599):43-642' '(0-649):643-1292' \
+                          '(0-699):1293-1992' '(0-776):1993-2769' \
+                          '(0-49):2770-2819' | cmp - layout"
+
+test_and_continue "free space should be a single area at the end" \
+                  "dumpe2fs disk.img 2>/dev/null \
+                   | grep '^  Free blocks: 2820-4095\$' > /dev/null"
+
+test_end
@@ -0,0 +1,167 @@
+/*
+    Copyright 2009 Enno Ruijters
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of version 2 of the GNU General
+    Public License as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Compares the red-black tree and the B+tree as block indexes, using the
+ * "which extent contains this block" lookups that dominate e2defrag's
+ * run time on big filesystems. Also checks that both give the same answers.
+ *
+ * Usage: indexbench [number of extents] [number of lookups]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "rbtree.h"
+#include "btree.h"
+
+#ifndef offsetof
+#define offsetof __builtin_offsetof
+#endif
+
+struct extent {
+	uint64_t start_block;
+	uint64_t end_block;
+	struct rb_node block_rb;
+};
+
+static void rb_insert_extent(struct rb_root *root, struct extent *e)
+{
+	struct rb_node **p = &root->rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		struct extent *extent;
+		parent = *p;
+		extent = rb_entry(parent, struct extent, block_rb);
+		if (e->start_block < extent->start_block)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&e->block_rb, parent, p);
+	rb_insert_color(&e->block_rb, root);
+}
+
+static struct extent *rb_containing(struct rb_root *root, uint64_t block)
+{
+	struct rb_node *n = root->rb_node;
+	while (n) {
+		struct extent *e = rb_entry(n, struct extent, block_rb);
+		if (block >= e->start_block && block <= e->end_block)
+			return e;
+		if (block > e->start_block)
+			n = n->rb_right;
+		else
+			n = n->rb_left;
+	}
+	return NULL;
+}
+
+static struct extent *btree_containing(struct btree *t, uint64_t block)
+{
+	struct extent *e = btree_floor(t, block);
+	if (e && block <= e->end_block)
+		return e;
+	return NULL;
+}
+
+static double seconds(struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec)
+	       + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long nr_extents = 1000000, nr_lookups = 10000000, i;
+	struct rb_root root = RB_ROOT;
+	struct btree tree;
+	struct extent *extents;
+	struct timespec start;
+	uint64_t *lookups, block = 0, found = 0;
+	double rb_time, bt_time;
+
+	if (argc > 1)
+		nr_extents = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		nr_lookups = strtoul(argv[2], NULL, 0);
+	extents = malloc(nr_extents * sizeof(*extents));
+	lookups = malloc(nr_lookups * sizeof(*lookups));
+	if (!extents || !lookups) {
+		printf("Out of memory\n");
+		return 1;
+	}
+	srand(42);
+	for (i = 0; i < nr_extents; i++) {
+		block += 1 + rand() % 16;
+		extents[i].start_block = block;
+		block += rand() % 16;
+		extents[i].end_block = block;
+	}
+	for (i = 0; i < nr_lookups; i++)
+		lookups[i] = ((uint64_t)rand() << 16 ^ rand()) % (block + 1);
+	/* Insert in random order, like the extents of a real filesystem */
+	for (i = nr_extents - 1; i > 0; i--) {
+		unsigned long j = rand() % (i + 1);
+		struct extent tmp = extents[i];
+		extents[i] = extents[j];
+		extents[j] = tmp;
+	}
+
+	btree_init(&tree);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr_extents; i++)
+		rb_insert_extent(&root, &extents[i]);
+	printf("rbtree insert: %8.3fs\n", seconds(&start));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr_extents; i++)
+		btree_insert(&tree, extents[i].start_block, &extents[i]);
+	printf("btree insert:  %8.3fs\n", seconds(&start));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr_lookups; i++)
+		found += rb_containing(&root, lookups[i]) != NULL;
+	rb_time = seconds(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr_lookups; i++)
+		found -= btree_containing(&tree, lookups[i]) != NULL;
+	bt_time = seconds(&start);
+	printf("rbtree lookup: %8.3fs\n", rb_time);
+	printf("btree lookup:  %8.3fs (%.2fx)\n", bt_time, rb_time / bt_time);
+
+	/* Remove half of the extents and check the answers still agree */
+	for (i = 0; i < nr_extents; i += 2) {
+		rb_erase(&extents[i].block_rb, &root);
+		btree_remove(&tree, extents[i].start_block);
+	}
+	for (i = 0; i < nr_lookups && !found; i++) {
+		if (rb_containing(&root, lookups[i])
+		    != btree_containing(&tree, lookups[i]))
+			found = 1;
+	}
+	btree_destroy(&tree);
+	free(lookups);
+	free(extents);
+	if (found) {
+		printf("Lookup results differ\n");
+		return 1;
+	}
+	return 0;
+}